@@ -0,0 +1,308 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <map>
+#include <new>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <jg_test_state.h>
+
+using namespace jg::test_state;
+
+// Allocation accounting for the bytes/op and allocs/op columns. The parallel formatting benchmarks allocate on
+// worker threads too.
+
+static std::atomic<std::size_t> allocated_bytes{0};
+static std::atomic<std::size_t> allocation_count{0};
+
+// GCC pairs the std::free() below with operator new instead of std::malloc() once both are inlined.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(std::size_t size)
+{
+    allocated_bytes += size;
+    ++allocation_count;
+    if (void* memory = std::malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+// Prevents the optimizer from removing the benchmarked work.
+
+static volatile std::size_t sink_size = 0;
+
+template <typename T>
+static void consume(const T& formatted)
+{
+    sink_size = sink_size + formatted.formatted.underlying.size();
+}
+
+class null_buffer final : public std::streambuf
+{
+protected:
+    int_type overflow(int_type ch) override
+    {
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char*, std::streamsize size) override
+    {
+        sink_size = sink_size + static_cast<std::size_t>(size);
+        return size;
+    }
+};
+
+struct vector2d
+{
+    int x;
+    int y;
+};
+
+static std::ostream& operator<<(std::ostream& stream, const vector2d& v)
+{
+    return stream << "(" << v.x << "," << v.y << ")";
+}
+
+static value nested(int depth)
+{
+    if (depth == 0)
+        return 4711;
+    return object({{"value", depth}, {"child", nested(depth - 1)}, {"flag", true}});
+}
+
+struct benchmark final
+{
+    const char* name;
+    std::function<void()> operation;
+};
+
+struct measurement final
+{
+    double nanoseconds_per_operation;
+    double bytes_per_operation;
+    double allocations_per_operation;
+};
+
+// Runs `operation` in batches that take at least `minimum_batch_time`, and reports the fastest of `batches`
+// batches, which is far more repeatable than the mean.
+static measurement measure(const std::function<void()>& operation, int batches, std::chrono::nanoseconds minimum_batch_time)
+{
+    using clock = std::chrono::steady_clock;
+
+    std::size_t iterations = 1;
+    for (;;) {
+        const auto start = clock::now();
+        for (std::size_t i = 0; i < iterations; ++i)
+            operation();
+        if (clock::now() - start >= minimum_batch_time)
+            break;
+        iterations *= 2;
+    }
+
+    measurement best{1e300, 0, 0};
+    for (int batch = 0; batch < batches; ++batch) {
+        const auto bytes_before = allocated_bytes.load();
+        const auto count_before = allocation_count.load();
+        const auto start = clock::now();
+        for (std::size_t i = 0; i < iterations; ++i)
+            operation();
+        const auto elapsed = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        const auto n = static_cast<double>(iterations);
+        if (elapsed / n < best.nanoseconds_per_operation)
+            best = {elapsed / n,
+                    static_cast<double>(allocated_bytes - bytes_before) / n,
+                    static_cast<double>(allocation_count - count_before) / n};
+    }
+    return best;
+}
+
+static std::vector<benchmark> benchmarks()
+{
+    static const std::vector<int> ints_4(4, 4711);
+    static const std::vector<int> ints_64(64, 4711);
+    static const std::vector<int> ints_1024(1024, 4711);
+    static const std::vector<float> floats_1024(1024, 3.1415926f);
+    static const std::vector<std::string> strings_64(64, "alpha");
+    static const std::vector<vector2d> points_64(64, vector2d{1, 2});
+    static const std::vector<vector2d> points_65536(65536, vector2d{1, 2});
+    static const std::vector<property> properties_4(4, property{"name", 4711});
+    static const std::vector<property> properties_64(64, property{"name", 4711});
+    static const std::map<std::string, int> map_64 = [] {
+        std::map<std::string, int> map;
+        for (int i = 0; i < 64; ++i)
+            map.emplace("name" + std::to_string(i), 4711);
+        return map;
+    }();
+    static const value nested_8 = nested(8);
+    static const std::string text = "the quick brown fox";
+    static const std::string long_text(1024, 'x');
+    static const std::string escaped_text = "line 1\nline \"2\"\tC:\\temp";
+    static const double pi = 3.1415926;
+    static int target = 0;
+
+    return {
+        {"value/int", [] { consume(value{4711}); }},
+        {"value/long long", [] { consume(value{-4711471147114711ll}); }},
+        {"value/double", [] { consume(value{pi}); }},
+        {"value/bool", [] { consume(value{true}); }},
+        {"value/nullptr", [] { consume(value{nullptr}); }},
+        {"value/pointer", [] { consume(value{&target}); }},
+        {"value/const char*", [] { consume(value{"the quick brown fox"}); }},
+        {"value/std::string", [] { consume(value{text}); }},
+        {"value/std::string 1024", [] { consume(value{long_text}); }},
+        {"value/std::string with escapes", [] { consume(value{escaped_text}); }},
+        {"value/user type", [] { consume(value{vector2d{1, 2}}); }},
+
+        {"property/int", [] { consume(property{"name", 4711}); }},
+        {"property/std::string", [] { consume(property{"name", text}); }},
+        {"property/user type", [] { consume(property{"name", vector2d{1, 2}}); }},
+
+        {"object/width 4", [] { consume(object(properties_4)); }},
+        {"object/width 64", [] { consume(object(properties_64)); }},
+        {"object/map width 64", [] { consume(object(map_64)); }},
+        {"object/depth 2", [] { consume(nested(2)); }},
+        {"object/depth 8", [] { consume(nested(8)); }},
+
+        {"array/int width 4", [] { consume(array(ints_4)); }},
+        {"array/int width 64", [] { consume(array(ints_64)); }},
+        {"array/int width 1024", [] { consume(array(ints_1024)); }},
+        {"array/float width 1024", [] { consume(array(floats_1024)); }},
+        {"array/string width 64", [] { consume(array(strings_64)); }},
+        {"array/user type width 64", [] { consume(array(points_64)); }},
+        {"array/user type width 65536", [] { consume(array(points_65536)); }},
+        {"array/user type width 65536 x4", [] {
+            global_settings().parallel_threshold = 4096;
+            global_settings().parallel_threads = 4;
+            consume(array(points_65536));
+            global_settings().parallel_threshold = std::numeric_limits<std::size_t>::max();
+            global_settings().parallel_threads = 0;
+        }},
+        {"array/depth 8", [] { consume(array({nested_8, nested_8})); }},
+
+        {"binary/value int", [] { sink_size = sink_size + binary::value{4711}.encoded.underlying.size(); }},
+        {"binary/array int width 1024", [] { sink_size = sink_size + binary::array(ints_1024).encoded.underlying.size(); }},
+        {"binary/object depth 2", [] {
+            sink_size = sink_size + binary::object({{"value", 2}, {"child", binary::object({{"value", 1}, {"flag", true}})}}).encoded.underlying.size();
+        }},
+        {"binary/render array int width 1024", [] {
+            static const binary::value encoded = binary::array(ints_1024);
+            consume(binary::render(encoded));
+        }},
+
+        {"output/+= value", [] {
+            output state;
+            for (int i = 0; i < 16; ++i)
+                state += i;
+            consume(state);
+        }},
+        {"output/+= value with prefix", [] {
+            output state{google_test_prefix()};
+            for (int i = 0; i < 16; ++i)
+                state += i;
+            consume(state);
+        }},
+        {"output/+= property with prefix", [] {
+            output state{google_test_prefix()};
+            for (int i = 0; i < 16; ++i)
+                state += {"name", i};
+            consume(state);
+        }},
+        {"concurrent_output/+= value", [] {
+            concurrent_output state;
+            for (int i = 0; i < 16; ++i)
+                state += i;
+            sink_size = sink_size + state.sequence.load();
+        }},
+        {"ring_output/+= value", [] {
+            static ring_output state{4096, 64};
+            for (int i = 0; i < 16; ++i)
+                state += i;
+            sink_size = sink_size + state.entry_count;
+        }},
+        {"sampled_output/+= user type 1 in 64", [] {
+            static sampled_output state{[] {
+                sampling policy;
+                policy.every_nth = 64;
+                return policy;
+            }()};
+            for (int i = 0; i < 16; ++i)
+                state += vector2d{i, i};
+            if (state.kept.formatted.underlying.size() > 65536)
+                state.kept = output{};
+        }},
+        {"delta_output/+= object width 64", [] {
+            static delta_output state;
+            static int step = 0;
+            state += object({{"step", ++step / 16}, {"properties", object(properties_64)}});
+            if (state.changes.formatted.underlying.size() > 65536)
+                state.changes = output{};
+        }},
+        {"interned_output/add property", [] {
+            static interned_output state;
+            for (int i = 0; i < 16; ++i)
+                state.add("name", i % 4 == 0);
+            if (state.entries.size() > 65536)
+                state.entries.clear();
+        }},
+#if !defined(_WIN32)
+        {"mapped_output/+= value", [] {
+            static mapped_output state{"/tmp/jg_test_state_bench_mapped.log"};
+            for (int i = 0; i < 16; ++i)
+                state += i;
+        }},
+#endif
+        {"output/stream to null sink", [] {
+            static const output state{google_test_prefix(), nested_8};
+            static null_buffer buffer;
+            static std::ostream stream{&buffer};
+            stream << state;
+        }},
+    };
+}
+
+// Usage: jg_test_state_bench [--quick] [name filter]
+int main(int argc, char* argv[])
+{
+    int batches = 7;
+    std::chrono::nanoseconds minimum_batch_time = std::chrono::milliseconds{20};
+    const char* filter = "";
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--quick") == 0) {
+            batches = 1;
+            minimum_batch_time = std::chrono::microseconds{100};
+        } else {
+            filter = argv[i];
+        }
+    }
+
+#ifndef NDEBUG
+    std::printf("warning: assertions are enabled, build with -DCMAKE_BUILD_TYPE=Release for representative results\n");
+#endif
+    std::printf("%-34s %12s %12s %12s\n", "benchmark", "ns/op", "bytes/op", "allocs/op");
+
+    for (const auto& benchmark : benchmarks()) {
+        if (!std::strstr(benchmark.name, filter))
+            continue;
+        const auto result = measure(benchmark.operation, batches, minimum_batch_time);
+        std::printf("%-34s %12.1f %12.1f %12.2f\n", benchmark.name, result.nanoseconds_per_operation,
+                    result.bytes_per_operation, result.allocations_per_operation);
+    }
+}
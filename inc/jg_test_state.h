@@ -2,16 +2,182 @@
 
 #include <ostream>
 #include <sstream>
-#include <iomanip>
 #include <iterator>
 #include <string>
 #include <initializer_list>
+#include <vector>
+#include <type_traits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <cmath>
+#include <new>
+#include <utility>
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <locale>
+#include <streambuf>
+#include <limits>
+#include <functional>
+#include <cerrno>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <tuple>
+#include <chrono>
+#include <cassert>
+
+#if defined(_MSVC_LANG) && _MSVC_LANG > __cplusplus
+#define JG_TEST_STATE_CPLUSPLUS _MSVC_LANG
+#else
+#define JG_TEST_STATE_CPLUSPLUS __cplusplus
+#endif
+
+// std::optional and std::variant values are formatted when they're available, which is in C++17 and later.
+#if JG_TEST_STATE_CPLUSPLUS >= 201703L && defined(__has_include)
+#if __has_include(<optional>) && __has_include(<variant>)
+#define JG_TEST_STATE_OPTIONAL_VARIANT
+#include <optional>
+#include <variant>
+#endif
+#endif
+
+// Floating point values are formatted by std::to_chars when it's available, and otherwise by Grisu3 with a
+// std::snprintf() and std::strtod() search as fallback, which produce the same text.
+#if JG_TEST_STATE_CPLUSPLUS >= 201703L && defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+#define JG_TEST_STATE_TO_CHARS
+#endif
+#endif
+#endif
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Define JG_TEST_STATE_NO_SIMD to use the portable word-at-a-time code paths instead of SIMD intrinsics.
+#if !defined(JG_TEST_STATE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define JG_TEST_STATE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Define JG_TEST_STATE_STATS to count the formatting work of each thread, see `statistics`. Otherwise the
+// counting compiles to nothing.
+#if defined(JG_TEST_STATE_STATS)
+#define JG_TEST_STATE_COUNT(counter, amount) ::jg::test_state::detail::count(::jg::test_state::detail::thread_statistics().counter, amount)
+#define JG_TEST_STATE_FORMATTING(buffer, is_entry) const ::jg::test_state::detail::formatting_scope jg_test_state_formatting{buffer, is_entry}
+#else
+#define JG_TEST_STATE_COUNT(counter, amount) static_cast<void>(0)
+#define JG_TEST_STATE_FORMATTING(buffer, is_entry) static_cast<void>(0)
+#endif
 
 namespace jg {
 namespace test_state {
 
+/// Memory that the text of values, properties and outputs is allocated from, like `std::pmr::memory_resource`,
+/// which C++14 doesn't have. Formatting allocates from the current resource of the thread, which is
+/// `new_delete_resource()` unless a `scoped_resource` has replaced it, and text is deallocated to the
+/// resource it was allocated from, also after the scope has ended or on another thread.
+class memory_resource
+{
+public:
+    virtual ~memory_resource() = default;
+    virtual void* allocate(std::size_t size, std::size_t alignment) = 0;
+    virtual void deallocate(void* memory, std::size_t size, std::size_t alignment) noexcept = 0;
+};
+
+memory_resource& new_delete_resource();
+memory_resource& current_resource();
+
+/// Arena that hands out memory from a buffer, and from blocks of geometrically growing size that it allocates
+/// from `upstream` when the buffer runs out. Deallocation does nothing, and all of the memory is freed at once
+/// when the arena is destroyed or released, so values allocated from it must not outlive it. It's
+/// synchronized, so that values formatted by many threads can allocate from the same arena.
+class monotonic_resource final : public memory_resource
+{
+public:
+    explicit monotonic_resource(std::size_t initial_size = 4096, memory_resource& upstream = new_delete_resource());
+    monotonic_resource(void* buffer, std::size_t size, memory_resource& upstream = new_delete_resource());
+    monotonic_resource(const monotonic_resource&) = delete;
+    monotonic_resource& operator=(const monotonic_resource&) = delete;
+    ~monotonic_resource() override;
+
+    void* allocate(std::size_t size, std::size_t alignment) override;
+    void deallocate(void* memory, std::size_t size, std::size_t alignment) noexcept override;
+    /// Frees the blocks allocated from `upstream`, and starts over from the buffer.
+    void release() noexcept;
+    std::size_t allocated() const; // Bytes handed out since construction or `release()`
+
+private:
+    struct block final
+    {
+        block* next;
+        std::size_t size;
+    };
+
+    mutable std::mutex mutex;
+    memory_resource& upstream;
+    char* const buffer;
+    const std::size_t buffer_size;
+    char* current;
+    std::size_t remaining;
+    std::size_t next_size;
+    std::size_t allocated_bytes{};
+    block* blocks{};
+};
+
+/// Makes formatting on the current thread allocate from `resource` during the lifetime of the scope. Scopes
+/// can be nested.
+class scoped_resource final
+{
+public:
+    explicit scoped_resource(memory_resource& resource);
+    scoped_resource(const scoped_resource&) = delete;
+    scoped_resource& operator=(const scoped_resource&) = delete;
+    ~scoped_resource();
+
+private:
+    memory_resource* const previous;
+};
+
 namespace detail {
 
+#if defined(JG_TEST_STATE_STATS)
+
+/// Counters of the formatting work of one thread. Only the owning thread writes them, so they're updated
+/// without read-modify-write operations, and other threads only read them when statistics are collected.
+struct statistics_counters final
+{
+    std::atomic<std::uint64_t> fast_values{};
+    std::atomic<std::uint64_t> stream_values{};
+    std::atomic<std::uint64_t> formatted_bytes{};
+    std::atomic<std::uint64_t> allocations{};
+    std::atomic<std::uint64_t> appended_entries{};
+    std::atomic<std::uint64_t> streamed_entries{};
+    std::atomic<std::uint64_t> formatting_nanoseconds{};
+    std::uint64_t stream_formats{}; // Values formatted by `operator<<`, including nested ones
+    int depth{};                    // Of nested `formatting_scope` instances
+};
+
+statistics_counters& thread_statistics();
+
+inline void count(std::atomic<std::uint64_t>& counter, std::uint64_t amount)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+#endif
+
 /// Default validation policy for a `strong_type` instance. The default behavior is to do no validation,
 /// which is why the body of `validate(const T& value)` is empty. If invariants or semantics must hold at
 /// construction, then create a policy that asserts or throws an exception in `validate(const T& value)`
@@ -41,13 +207,353 @@ struct strong_type final
     T underlying{};
 };
 
+/// String storage with room for `inline_capacity` characters inside the object itself, so that the formatted
+/// text of typical leaf values and small objects doesn't allocate. Longer text moves to the heap, where
+/// appending is amortized constant time like for `std::string`. Only the part of the `std::string` interface
+/// that formatting needs is provided, and the text isn't null terminated.
+class small_string final
+{
+public:
+    static constexpr std::size_t inline_capacity = 40;
+
+    small_string() noexcept {}
+    small_string(const char* text)
+    {
+        append(text, std::strlen(text));
+    }
+    small_string(const char* text, std::size_t size)
+    {
+        append(text, size);
+    }
+    small_string(const std::string& text)
+    {
+        append(text.data(), text.size());
+    }
+    small_string(const small_string& other)
+    {
+        append(other.first, other.length);
+    }
+    small_string(small_string&& other) noexcept
+    {
+        take(other);
+    }
+    small_string& operator=(const small_string& other)
+    {
+        if (this != &other) {
+            length = 0;
+            append(other.first, other.length);
+        }
+        return *this;
+    }
+    small_string& operator=(small_string&& other) noexcept
+    {
+        if (this != &other) {
+            release();
+            take(other);
+        }
+        return *this;
+    }
+    ~small_string()
+    {
+        release();
+    }
+
+    char* data() noexcept { return first; }
+    const char* data() const noexcept { return first; }
+    std::size_t size() const noexcept { return length; }
+    std::size_t capacity() const noexcept { return room; }
+    bool empty() const noexcept { return length == 0; }
+    char& operator[](std::size_t index) noexcept { return first[index]; }
+    const char& operator[](std::size_t index) const noexcept { return first[index]; }
+    const char* begin() const noexcept { return first; }
+    const char* end() const noexcept { return first + length; }
+    std::string str() const { return std::string(first, length); }
+
+    void clear() noexcept
+    {
+        length = 0;
+    }
+
+    void reserve(std::size_t size)
+    {
+        if (size > room)
+            reallocate(size);
+    }
+
+    void resize(std::size_t size)
+    {
+        if (size > length) {
+            reserve(size);
+            std::memset(first + length, 0, size - length);
+        }
+        length = size;
+    }
+
+    // Sets the size after characters up to `size`, which is at most the reserved capacity, were written into
+    // `data()`. Unlike `resize()`, it doesn't initialize the characters first.
+    void set_size(std::size_t size) noexcept
+    {
+        length = size;
+    }
+
+    void shrink_to_fit()
+    {
+        if (first != storage && length < room)
+            reallocate(length);
+    }
+
+    small_string& append(const char* text, std::size_t size)
+    {
+        if (size > room - length)
+            grow(length + size);
+        std::memcpy(first + length, text, size);
+        length += size;
+        return *this;
+    }
+
+    small_string& append(const char* first_char, const char* last_char)
+    {
+        return append(first_char, static_cast<std::size_t>(last_char - first_char));
+    }
+
+    small_string& insert(std::size_t position, const char* text, std::size_t size)
+    {
+        open_gap(position, size);
+        std::memcpy(first + position, text, size);
+        return *this;
+    }
+
+    small_string& insert(std::size_t position, std::size_t count, char ch)
+    {
+        open_gap(position, count);
+        std::memset(first + position, ch, count);
+        return *this;
+    }
+
+    small_string& operator+=(char ch)
+    {
+        if (length == room)
+            grow(length + 1);
+        first[length++] = ch;
+        return *this;
+    }
+
+    small_string& operator+=(const char* text) { return append(text, std::strlen(text)); }
+    small_string& operator+=(const std::string& text) { return append(text.data(), text.size()); }
+    small_string& operator+=(const small_string& text) { return append(text.first, text.length); }
+
+private:
+    void grow(std::size_t size)
+    {
+        reallocate(size > 2 * room ? size : 2 * room);
+    }
+
+    // Moves the characters to a heap block of `capacity` characters, or back inline if they fit there.
+    void reallocate(std::size_t capacity)
+    {
+        char* const memory = capacity <= inline_capacity ? storage : allocate(capacity);
+        if (memory == first)
+            return;
+        if (memory != storage)
+            JG_TEST_STATE_COUNT(allocations, 1);
+        std::memcpy(memory, first, length);
+        release();
+        first = memory;
+        room = capacity <= inline_capacity ? inline_capacity : capacity;
+    }
+
+    // Heap blocks start with a pointer to the resource they were allocated from.
+    static constexpr std::size_t header_size = sizeof(memory_resource*);
+
+    static char* allocate(std::size_t capacity)
+    {
+        auto& resource = current_resource();
+        auto* const block = static_cast<char*>(resource.allocate(header_size + capacity, alignof(memory_resource*)));
+        auto* const address = &resource;
+        std::memcpy(block, &address, header_size);
+        return block + header_size;
+    }
+
+    void release() noexcept
+    {
+        if (first == storage)
+            return;
+        char* const block = first - header_size;
+        memory_resource* resource;
+        std::memcpy(&resource, block, header_size);
+        resource->deallocate(block, header_size + room, alignof(memory_resource*));
+    }
+
+    void take(small_string& other) noexcept
+    {
+        if (other.first == other.storage) {
+            std::memcpy(storage, other.storage, other.length);
+            first = storage;
+            room = inline_capacity;
+        } else {
+            first = other.first;
+            room = other.room;
+            other.first = other.storage;
+            other.room = inline_capacity;
+        }
+        length = other.length;
+        other.length = 0;
+    }
+
+    void open_gap(std::size_t position, std::size_t size)
+    {
+        if (size > room - length)
+            grow(length + size);
+        std::memmove(first + position + size, first + position, length - position);
+        length += size;
+    }
+
+    char* first{storage};
+    std::size_t length{};
+    std::size_t room{inline_capacity};
+    char storage[inline_capacity];
+};
+
+inline bool operator==(const small_string& left, const small_string& right)
+{
+    return left.size() == right.size() && std::memcmp(left.data(), right.data(), left.size()) == 0;
+}
+
+inline bool operator!=(const small_string& left, const small_string& right)
+{
+    return !(left == right);
+}
+
+inline std::ostream& operator<<(std::ostream& stream, const small_string& text)
+{
+    return stream.write(text.data(), static_cast<std::streamsize>(text.size()));
+}
+
+/// Stack of flags that keeps the first 64 flags inline, and only allocates for deeper stacks.
+class flag_stack final
+{
+public:
+    bool empty() const noexcept { return depth == 0; }
+
+    void push_back(bool flag)
+    {
+        if (depth >= 64)
+            deeper.push_back(flag);
+        else if (flag)
+            bits |= std::uint64_t{1} << depth;
+        else
+            bits &= ~(std::uint64_t{1} << depth);
+        ++depth;
+    }
+
+    void pop_back()
+    {
+        assert(depth > 0);
+        if (--depth >= 64)
+            deeper.pop_back();
+    }
+
+    bool back() const
+    {
+        assert(depth > 0);
+        return depth > 64 ? deeper.back() : ((bits >> (depth - 1)) & 1) != 0;
+    }
+
+    void set_back(bool flag)
+    {
+        pop_back();
+        push_back(flag);
+    }
+
+    void clear() noexcept
+    {
+        depth = 0;
+        deeper.clear();
+    }
+
+private:
+    std::uint64_t bits{};
+    std::size_t depth{};
+    std::vector<bool> deeper;
+};
+
+#if defined(JG_TEST_STATE_STATS)
+
+/// Counts what's formatted into `buffer` during the lifetime of the scope: the bytes, the time it takes, and
+/// whether a value was formatted by `operator<<` or by a fast path. Nested scopes are only counted by the
+/// outermost one.
+class formatting_scope final
+{
+public:
+    formatting_scope(const small_string& buffer, bool is_entry);
+    formatting_scope(const formatting_scope&) = delete;
+    formatting_scope& operator=(const formatting_scope&) = delete;
+    ~formatting_scope();
+
+private:
+    statistics_counters& counters;
+    const small_string& buffer;
+    const std::size_t begin;
+    const std::uint64_t stream_formats;
+    const std::chrono::steady_clock::time_point start;
+    const bool is_entry;
+};
+
+#endif
+
 } // namespace detail
 
-using prefix_string = detail::strong_type<std::string, struct prefix_tag>;
-using formatted_string = detail::strong_type<std::string, struct formatted_tag>;
+using prefix_string = detail::strong_type<detail::small_string, struct prefix_tag>;
+using formatted_string = detail::strong_type<detail::small_string, struct formatted_tag>;
 
 prefix_string google_test_prefix();
 
+/// How floating point values are formatted. Both decimal formats output the digits in fixed notation for
+/// decimal exponents from -4 up to a limit, and in scientific notation otherwise, like "%g" does. The output
+/// doesn't depend on the locale. The shortest and hex formats of float and double are the same on every
+/// platform, while the digits of the precision format and of hex `long double` come from the C runtime.
+enum class floating_point_format
+{
+    /// The shortest text that reads back as the same value, like `std::to_chars`. Fixed notation is used up
+    /// to an exponent of 15, like 1234567 and 0.0001, and scientific notation otherwise, like 1e+16.
+    shortest,
+    /// Rounded to `settings::floating_point_precision` significant digits, like "%.*g" and `std::ostream` with
+    /// `std::setprecision`. Fixed notation is used for exponents less than the precision.
+    precision,
+    /// Exact hexadecimal, like "%a" of glibc, without trailing zeros, for example 0x1.8p+1 and 0x1p-1.
+    hex,
+};
+
+/// Process-wide formatting settings. Configure them before formatting starts, for example in the `main()`
+/// of a test program, since they aren't synchronized. Truncated output ends with a "... (+N more)" marker.
+struct settings final
+{
+    /// Entries are truncated, or dropped, once an output would grow beyond this number of bytes. The marker
+    /// at the end counts the omitted bytes.
+    std::size_t max_output_bytes = std::numeric_limits<std::size_t>::max();
+    /// Arrays and objects created by `array(...)` and `object(...)` are truncated after this number of
+    /// elements. The marker counts the omitted elements.
+    std::size_t max_elements = std::numeric_limits<std::size_t>::max();
+    /// String values are truncated after this number of bytes, without splitting UTF-8 sequences. The marker
+    /// is output inside the quotes and counts the omitted bytes.
+    std::size_t max_string_length = std::numeric_limits<std::size_t>::max();
+    /// String values and property names are escaped like JSON strings, so that quotes, backslashes and control
+    /// characters in them don't break the output.
+    bool escape_strings = true;
+    floating_point_format floating_point = floating_point_format::shortest;
+    /// Significant digits of `floating_point_format::precision`, from 1 to `max_digits10` of the type.
+    std::size_t floating_point_precision = 6;
+    /// Arrays and objects created by `array(...)` and `object(...)` from random access ranges of at least this
+    /// many elements are formatted in chunks on `parallel_threads` threads. The output is the same as when
+    /// formatting them on one thread, but the stream output operators of the elements must be thread-safe.
+    std::size_t parallel_threshold = std::numeric_limits<std::size_t>::max();
+    /// Threads that format a range in parallel, including the calling thread. 0 means
+    /// `std::thread::hardware_concurrency()`.
+    std::size_t parallel_threads = 0;
+};
+
+settings& global_settings();
+
 struct value;
 struct property;
 
@@ -55,18 +561,26 @@ struct output final
 {
     output() = default;
     output(const value& value);
+    output(value&& value);
     output(const property& property);
+    output(property&& property);
     output(prefix_string prefix);
     output(prefix_string prefix, const value& value);
+    output(prefix_string prefix, value&& value);
     output(prefix_string prefix, const property& property);
+    output(prefix_string prefix, property&& property);
 
     prefix_string prefix;
     formatted_string formatted;
+    std::size_t omitted_bytes{}; // Bytes omitted due to `settings::max_output_bytes`
 };
 
 std::ostream& operator<<(std::ostream& stream, const output& output);
+/// The rvalue overloads move the formatted text of the first entry into an output instead of copying it.
 output& operator+=(output& output, const property& property);
+output& operator+=(output& output, property&& property);
 output& operator+=(output& output, const value& value);
+output& operator+=(output& output, value&& value);
 
 struct value final
 {
@@ -77,73 +591,4124 @@ struct value final
 };
 
 std::ostream& operator<<(std::ostream& stream, const value& value);
+/// The iterator overloads of `array(...)` and `object(...)` accept any input iterator and consume the range in
+/// a single pass, and the end of the range can be a sentinel of another type than the iterator. That way,
+/// lazily produced sequences can be output without building an intermediate container. `object(...)` also
+/// accepts ranges of key/value pairs, like `std::map` and `std::unordered_map`, and quotes the keys as names.
 value array(std::initializer_list<value> values);
-template <typename TIterator>
-value array(TIterator first_value, TIterator last_value);
+template <typename TIterator, typename TSentinel>
+value array(TIterator first_value, TSentinel last_value);
 template <typename TRange>
 value array(const TRange& values);
 
-value object(property property);
-value object(std::initializer_list<property> properties);
+value object(const property& property);
+value object(property&& property);
+value object(std::initializer_list<property> properties);
+template <typename TIterator, typename TSentinel>
+value object(TIterator first_property, TSentinel last_property);
+template <typename TRange>
+value object(const TRange& properties);
+
+#if defined(JG_TEST_STATE_STATS)
+
+/// Formatting work counted when `JG_TEST_STATE_STATS` is defined. Each thread counts its own work, and
+/// `collect_statistics()` sums the counters of all threads, including those that have exited.
+struct statistics final
+{
+    std::uint64_t fast_values;            // Values formatted without a `std::ostream`
+    std::uint64_t stream_values;          // Values formatted by `operator<<`
+    std::uint64_t formatted_bytes;
+    std::uint64_t allocations;            // Heap allocations of formatting buffers
+    std::uint64_t appended_entries;       // Entries added to outputs
+    std::uint64_t streamed_entries;       // Entries streamed from outputs
+    std::uint64_t formatting_nanoseconds;
+};
+
+statistics collect_statistics();
+/// The statistics as one object, like `{ "fast_values": 10, "stream_values": 2, ... }`.
+value object(const statistics& statistics);
+/// Writes `object(collect_statistics())` as one line to `file` when the process exits.
+void dump_statistics_at_exit(std::FILE* file = stderr);
+
+#endif
+
+struct property final
+{
+    property(const std::string& name, const value& value);
+    property(const std::string& name, value&& value);
+
+    formatted_string formatted;
+};
+
+std::ostream& operator<<(std::ostream& stream, const property& property);
+
+/// Values of user-defined types are formatted by their stream output operator, using a per-thread pool of
+/// reusable streams with the classic locale. The stream flags, precision, width, fill and locale are reset
+/// before each use, but other stream state, like `iword()` and `pword()`, isn't. Specialize this trait as
+/// `std::false_type` for types whose stream output operator depends on a pristine stream, to format them
+/// with a new `std::ostringstream` each time instead.
+template <typename T>
+struct reuse_stream : std::true_type {};
+
+/// Streaming builder that writes objects, arrays, properties and values token by token into one growing
+/// buffer, so that deeply nested state is formatted in linear time instead of being copied once per nesting
+/// level. A default constructed builder owns its buffer, and `release()` hands it over as a `value`. A builder
+/// constructed from an `output` writes directly into that output, where each top-level value or property
+/// becomes a separate (prefixed) output line, just like `output::operator+=`.
+class builder final
+{
+public:
+    builder() = default;
+    explicit builder(output& output);
+
+    builder& begin_object();
+    builder& end_object();
+    builder& begin_array();
+    builder& end_array();
+    /// Starts a property with the given name. The next value, object or array becomes the property value.
+    builder& key(const std::string& name);
+    template <typename T>
+    builder& value(const T& value);
+    builder& value(const test_state::value& value);
+    builder& property(const test_state::property& property);
+    /// Adds a "... (+count more)" element that marks omitted elements.
+    builder& omitted(std::size_t count);
+    /// Hands over the buffer of a default constructed builder as a `value`. Every object and array that was
+    /// begun must have been ended, which is asserted, as is ending one that wasn't begun.
+    test_state::value release();
+
+private:
+    detail::small_string& buffer();
+    void begin_element();
+    void end_element();
+    void end_level(char bracket);
+
+    detail::small_string owned;
+    output* target{};
+    std::size_t entry_begin{};
+    detail::flag_stack levels; // One entry per open object or array, true if it has elements
+    bool keyed{};
+};
+
+namespace detail {
+
+/// Type erased copy of a value captured by `deferred_output`. Captured values that are small enough are
+/// stored inline, and larger ones on the heap. C strings are captured as `std::string` so that they don't
+/// have to outlive the capture.
+class captured_value final
+{
+public:
+    template <typename T>
+    explicit captured_value(T&& value);
+    captured_value(captured_value&& other) noexcept;
+    captured_value(const captured_value&) = delete;
+    captured_value& operator=(const captured_value&) = delete;
+    captured_value& operator=(captured_value&&) = delete;
+    ~captured_value();
+
+    void format(small_string& buffer) const;
+
+private:
+    struct operations final
+    {
+        void (*format)(const void* value, small_string& buffer);
+        void (*move)(void* from, void* to);
+        void (*destroy)(void* value);
+    };
+
+    template <typename TStored, typename T> void emplace(T&& value, std::true_type fits_inline);
+    template <typename TStored, typename T> void emplace(T&& value, std::false_type fits_inline);
+    template <typename T> static const operations* inline_operations();
+    template <typename T> static const operations* heap_operations();
+
+    static constexpr std::size_t inline_size = 48;
+    alignas(std::max_align_t) unsigned char storage[inline_size];
+    const operations* ops;
+};
+
+/// Name and captured value of a property added to `deferred_output`.
+template <typename T>
+struct deferred_property final
+{
+    std::string name;
+    T value;
+};
+
+} // namespace detail
+
+/// Output that captures values and properties by copy (or by move) and formats them first when the output is
+/// streamed. This makes state that is only streamed when a test assertion fails practically free for passing
+/// assertions. The formatted text is cached, so streaming the output again only formats entries that were
+/// added since the previous time it was streamed. Captured pointers, except C strings, must stay valid until
+/// the output is streamed.
+struct deferred_output final
+{
+    deferred_output() = default;
+    explicit deferred_output(prefix_string prefix);
+
+    template <typename T>
+    deferred_output& add(T&& value);
+    template <typename T>
+    deferred_output& add(std::string name, T&& value);
+
+    prefix_string prefix;
+    std::vector<detail::captured_value> captured;
+    mutable formatted_string formatted;
+    mutable std::size_t formatted_count{};
+    mutable std::size_t omitted_bytes{}; // Bytes omitted due to `settings::max_output_bytes`
+};
+
+std::ostream& operator<<(std::ostream& stream, const deferred_output& output);
+template <typename T>
+deferred_output& operator+=(deferred_output& output, T&& value);
+deferred_output& operator+=(deferred_output& output, const property& property);
+
+using file_descriptor = detail::strong_type<int, struct file_descriptor_tag>;
+
+/// Output that writes its entries to a sink, a `std::ostream`, `FILE*`, file descriptor or user callback,
+/// instead of keeping them, so that memory use stays constant however much state is added. Each entry is
+/// formatted directly into a reusable buffer, terminated by a newline, and the buffer is written to the sink
+/// in batches of `batch_size` bytes, when `flush()` is called, and when the output is destroyed. A
+/// `batch_size` of 0 writes each entry as soon as it's added.
+struct sink_output final
+{
+    using write_function = std::function<void(const char* data, std::size_t size)>;
+    static constexpr std::size_t default_batch_size = 4096;
+
+    explicit sink_output(std::ostream& stream, prefix_string prefix = {}, std::size_t batch_size = default_batch_size);
+    explicit sink_output(std::FILE* file, prefix_string prefix = {}, std::size_t batch_size = default_batch_size);
+    explicit sink_output(file_descriptor descriptor, prefix_string prefix = {}, std::size_t batch_size = default_batch_size);
+    explicit sink_output(write_function write, prefix_string prefix = {}, std::size_t batch_size = default_batch_size);
+    sink_output(const sink_output&) = delete;
+    sink_output& operator=(const sink_output&) = delete;
+    ~sink_output();
+
+    /// Formats `value` directly into the buffer, without creating a `value` first.
+    template <typename T>
+    sink_output& add(const T& value);
+    template <typename T>
+    sink_output& add(const std::string& name, const T& value);
+    void flush();
+
+    prefix_string prefix;
+    write_function write;
+    std::size_t batch_size;
+    detail::small_string pending;
+};
+
+sink_output& operator+=(sink_output& output, const value& value);
+sink_output& operator+=(sink_output& output, const property& property);
+
+namespace detail {
+
+/// The entries that one thread added to a `concurrent_output`, with the sequence number of each entry.
+struct output_shard final
+{
+    struct entry final
+    {
+        std::uint64_t sequence;
+        std::size_t end; // End offset of the entry in `text`
+    };
+
+    std::thread::id owner;
+    small_string text;
+    std::vector<entry> entries;
+    std::size_t omitted_bytes{}; // Bytes of the entries dropped due to `settings::max_output_bytes`
+};
+
+} // namespace detail
+
+/// Output that many threads can add to at the same time, without locks or contention other than taking a
+/// sequence number. Each thread adds entries to its own shard, and streaming the output merges the entries
+/// of all shards in the order they were added. Streaming must not happen while entries are being added,
+/// for example it can happen after the threads that add entries have been joined. Entries that are added
+/// once the shards hold `settings::max_output_bytes` are dropped, and the streamed output is truncated like
+/// the one of an `output`.
+struct concurrent_output final
+{
+    concurrent_output();
+    explicit concurrent_output(prefix_string prefix);
+    concurrent_output(const concurrent_output&) = delete;
+    concurrent_output& operator=(const concurrent_output&) = delete;
+
+    template <typename T>
+    concurrent_output& add(const T& value);
+    template <typename T>
+    concurrent_output& add(const std::string& name, const T& value);
+
+    prefix_string prefix;
+    const std::uint64_t id;
+    std::atomic<std::uint64_t> sequence{};
+    std::atomic<std::size_t> bytes{}; // Bytes of the entries added to all shards, if `max_output_bytes` is set
+    std::mutex shards_mutex; // Only taken when a thread adds its first entry
+    std::vector<std::unique_ptr<detail::output_shard>> shards;
+};
+
+std::ostream& operator<<(std::ostream& stream, const concurrent_output& output);
+concurrent_output& operator+=(concurrent_output& output, const value& value);
+concurrent_output& operator+=(concurrent_output& output, const property& property);
+
+/// Flight recorder output that keeps only the most recent entries, within a fixed capacity of bytes and
+/// entries that is allocated once. When adding an entry exceeds the capacity, the oldest entries are
+/// overwritten, which is O(1) per entry. Entries are formatted in a reusable buffer, so adding them doesn't
+/// allocate once that buffer has grown to fit the largest entry. An entry larger than the byte capacity is
+/// truncated. Streaming outputs the remaining entries, oldest first.
+struct ring_output final
+{
+    ring_output(std::size_t capacity_bytes, std::size_t capacity_entries, prefix_string prefix = {});
+
+    template <typename T>
+    ring_output& add(const T& value);
+    template <typename T>
+    ring_output& add(const std::string& name, const T& value);
+
+    struct entry final
+    {
+        std::size_t offset;
+        std::size_t size;
+    };
+
+    prefix_string prefix;
+    std::vector<char> bytes;
+    std::vector<entry> entries;
+    std::size_t oldest_entry{};
+    std::size_t entry_count{};
+    std::size_t oldest_byte{};
+    std::size_t byte_count{};
+    std::size_t overwritten{}; // Number of entries that have been overwritten
+    detail::small_string scratch;
+};
+
+std::ostream& operator<<(std::ostream& stream, const ring_output& output);
+ring_output& operator+=(ring_output& output, const value& value);
+ring_output& operator+=(ring_output& output, const property& property);
+
+/// When `sampled_output` keeps an entry. An entry is kept when `condition` is unset or returns true, it's the
+/// first of every `every_nth` entries added, and fewer than `max_per_window` entries have been kept in the
+/// current time window. An `every_nth` of 0 or 1 doesn't skip any entries.
+struct sampling final
+{
+    std::size_t every_nth = 1;
+    std::size_t max_per_window = std::numeric_limits<std::size_t>::max();
+    std::chrono::steady_clock::duration window = std::chrono::seconds{1};
+    std::function<bool()> condition;
+};
+
+/// Output for hot loops, like simulation steps, that keeps only a sample of the entries added to it.
+/// `add(...)` and `+=` decide whether an entry is kept before it's formatted, so skipping an entry costs a
+/// counter increment (and reading the clock, if `max_per_window` is set). Properties that are added with
+/// `+= {"name", value}` are formatted before they're skipped, so use `add("name", value)` instead. Streaming
+/// outputs the kept entries like `output` does, followed by a "... (+N skipped)" marker.
+struct sampled_output final
+{
+    explicit sampled_output(sampling policy, prefix_string prefix = {});
+
+    /// Returns whether the next entry is kept, and counts it as skipped if it isn't.
+    bool sample();
+    template <typename T>
+    sampled_output& add(const T& value);
+    template <typename T>
+    sampled_output& add(const std::string& name, const T& value);
+
+    sampling policy;
+    output kept;
+    std::size_t seen{};
+    std::size_t skipped{};
+    std::size_t window_count{}; // Entries kept in the current window
+    std::chrono::steady_clock::time_point window_start{};
+};
+
+std::ostream& operator<<(std::ostream& stream, const sampled_output& output);
+template <typename T>
+sampled_output& operator+=(sampled_output& output, const T& value);
+sampled_output& operator+=(sampled_output& output, const property& property);
+
+namespace detail {
+
+/// A property of the object text kept by `delta_output`, as offsets into that text. The name includes its
+/// quotes.
+struct snapshot_field final
+{
+    std::size_t name_begin;
+    std::size_t name_size;
+    std::size_t value_begin;
+    std::size_t value_size;
+    bool matched;
+};
+
+} // namespace detail
+
+/// Output for snapshots of state, like an `object(...)` that is added on every step of a simulation, that
+/// stores only what changed since the previous snapshot. Each snapshot is compared per property name with the
+/// previous one, and an entry with the properties that were added or changed, and those that were removed
+/// (with the value `(removed)`), is stored. A snapshot without changes stores nothing and is counted in
+/// `unchanged`. Snapshots that aren't objects, or objects that were truncated by `settings::max_elements`,
+/// are compared as a whole. Once the buffers have grown to fit a snapshot, comparing doesn't allocate.
+///
+/// The properties are found in the formatted text of the snapshot. A property ends at a ", " that is followed
+/// by the next quoted name and ": ", outside of strings and of `{ }`, `[ ]` and `( )`, so user-defined text
+/// like `P(1, 2)` or `1, 2` stays within its property. Text from a stream output operator with unbalanced
+/// brackets, or that contains `, "name": ` itself, can't be split, and such snapshots are compared as a
+/// whole and counted in `whole_snapshots`.
+struct delta_output final
+{
+    delta_output() = default;
+    explicit delta_output(prefix_string prefix);
+
+    delta_output& add(const value& snapshot);
+
+    output changes;
+    std::size_t snapshots{};
+    std::size_t unchanged{};       // Snapshots without changes
+    std::size_t whole_snapshots{}; // Snapshots compared as a whole, since they couldn't be split into properties
+    detail::small_string previous;
+    bool previous_is_object{};
+    std::vector<detail::snapshot_field> fields;         // Properties of `previous`
+    std::vector<detail::snapshot_field> current_fields; // Reused while comparing
+};
+
+std::ostream& operator<<(std::ostream& stream, const delta_output& output);
+delta_output& operator+=(delta_output& output, const value& snapshot);
+
+/// Compact binary capture of test state. The `binary` counterparts of `value`, `property`, `array(...)`,
+/// `object(...)` and `output` encode what they're given instead of formatting it, which for numbers is
+/// little more than a copy of their bytes. The encoding is rendered to exactly the text that the text
+/// counterparts would have formatted, when it's streamed or with `render(...)`, or offline by the
+/// `jg_test_state_render` tool. Values of user-defined types are still formatted when they're captured.
+namespace binary {
+
+/// Tags of the binary encoding. Numbers, characters and pointers are a tag followed by their bytes, in host
+/// byte order. Strings, property names and preformatted text are a tag followed by a LEB128 length and that
+/// many bytes. Objects and arrays are enclosed in begin and end tags. The encoding is meant to be rendered on
+/// the same platform that captured it.
+enum class tag : unsigned char
+{
+    null,
+    false_value,
+    true_value,
+    int16,
+    int32,
+    int64,
+    uint16,
+    uint32,
+    uint64,
+    float32,
+    float64,
+    long_double,
+    character,
+    pointer,
+    string,
+    text,
+    name,
+    begin_object,
+    end_object,
+    begin_array,
+    end_array,
+    number_run, // Tag of the numbers, LEB128 count and that many numbers, each an element of the enclosing array
+    omitted,    // LEB128 count of elements omitted due to `settings::max_elements`
+    truncated_string // A string, then the LEB128 count of bytes omitted due to `settings::max_string_length`
+};
+
+using encoded_string = detail::strong_type<std::string, struct encoded_tag>;
+
+struct value;
+struct property;
+
+struct value final
+{
+    explicit value(encoded_string encoded);
+    template <typename T> value(const T& value);
+
+    encoded_string encoded;
+};
+
+std::ostream& operator<<(std::ostream& stream, const value& value);
+value array(std::initializer_list<value> values);
+template <typename TIterator, typename TSentinel>
+value array(TIterator first_value, TSentinel last_value);
+template <typename TRange>
+value array(const TRange& values);
+
+value object(const property& property);
+value object(std::initializer_list<property> properties);
+template <typename TIterator, typename TSentinel>
+value object(TIterator first_property, TSentinel last_property);
+template <typename TRange>
+value object(const TRange& properties);
+
+struct property final
+{
+    property(const std::string& name, const value& value);
+
+    encoded_string encoded;
+};
+
+struct output final
+{
+    output() = default;
+    explicit output(prefix_string prefix);
+
+    /// Encodes `value` directly into the output, without creating a `value` first.
+    template <typename T>
+    output& add(const T& value);
+    template <typename T>
+    output& add(const std::string& name, const T& value);
+
+    prefix_string prefix;
+    encoded_string encoded; // The encoded entries, one after the other
+};
+
+std::ostream& operator<<(std::ostream& stream, const output& output);
+output& operator+=(output& output, const value& value);
+output& operator+=(output& output, value&& value);
+output& operator+=(output& output, const property& property);
+output& operator+=(output& output, property&& property);
+
+/// Renders a sequence of encoded entries, like `output::encoded`, into `target`. Returns false, and leaves out
+/// the last entry, if the encoding is malformed or truncated.
+bool render(test_state::output& target, const char* encoded, std::size_t size);
+test_state::value render(const value& value);
+test_state::output render(const output& output);
+
+} // namespace binary
+
+namespace detail {
+
+template <typename T>
+void encode_value(std::string& buffer, const T& value);
+void encode_value(std::string& buffer, const std::string& value);
+template <typename T>
+void encode_value(std::string& buffer, T* value);
+template <typename T>
+void encode_value(std::string& buffer, const T* value);
+void encode_value(std::string& buffer, std::nullptr_t);
+void encode_value(std::string& buffer, char* value);
+void encode_value(std::string& buffer, const char* value);
+void encode_value(std::string& buffer, bool value);
+void encode_value(std::string& buffer, const value& value);
+void encode_value(std::string& buffer, const binary::value& value);
+void encode_name(std::string& buffer, const std::string& name);
+template <typename T>
+void encode_key(std::string& buffer, const T& key);
+void encode_key(std::string& buffer, const std::string& key);
+void encode_key(std::string& buffer, const char* key);
+template <typename T1, typename T2>
+void encode_value(std::string& buffer, const std::pair<T1, T2>& pair);
+template <typename... T>
+void encode_value(std::string& buffer, const std::tuple<T...>& tuple);
+#if defined(JG_TEST_STATE_OPTIONAL_VARIANT)
+template <typename T>
+void encode_value(std::string& buffer, const std::optional<T>& optional);
+void encode_value(std::string& buffer, std::nullopt_t);
+template <typename... T>
+void encode_value(std::string& buffer, const std::variant<T...>& variant);
+void encode_value(std::string& buffer, std::monostate);
+#endif
+
+} // namespace detail
+
+#if !defined(_WIN32)
+
+/// Output that appends its entries to a memory-mapped file, so that they survive the test process crashing or
+/// being killed, without a system call per entry. The file starts with a small header with a magic number and
+/// the number of bytes of entries that have been completely written, which is updated after each entry. The
+/// entries are the same text that `output` would have, and are read with `read_mapped_log(...)` or by the
+/// `jg_test_state_render` tool, truncated like those of an `output` by `settings::max_output_bytes`. The file
+/// grows as needed, and is truncated to its entries when the output is destroyed. If the file can't be
+/// created or mapped, `mapped()` is false and entries are ignored.
+struct mapped_output final
+{
+    static constexpr std::size_t default_capacity = 1 << 20;
+
+    explicit mapped_output(const std::string& path, prefix_string prefix = {}, std::size_t capacity = default_capacity);
+    mapped_output(const mapped_output&) = delete;
+    mapped_output& operator=(const mapped_output&) = delete;
+    ~mapped_output();
+
+    template <typename T>
+    mapped_output& add(const T& value);
+    template <typename T>
+    mapped_output& add(const std::string& name, const T& value);
+    bool mapped() const;
+
+    prefix_string prefix;
+    int descriptor{-1};
+    char* mapping{};
+    std::size_t capacity{}; // Bytes of the file and the mapping, including the header
+    std::size_t omitted_bytes{}; // Bytes omitted due to `settings::max_output_bytes`
+    detail::small_string scratch;
+};
+
+std::ostream& operator<<(std::ostream& stream, const mapped_output& output);
+mapped_output& operator+=(mapped_output& output, const value& value);
+mapped_output& operator+=(mapped_output& output, const property& property);
+
+/// Reads the entries of a file written by `mapped_output`, also after the writing process crashed. Returns false
+/// if the file can't be read or wasn't written by `mapped_output`.
+bool read_mapped_log(const std::string& path, std::string& entries);
+bool read_mapped_log(const char* data, std::size_t size, std::string& entries);
+
+#endif
+
+namespace detail {
+
+/// Set of texts, each stored once in one buffer and identified by the index it was inserted at. Lookups hash
+/// the text and probe an open addressing table, so they don't allocate.
+class text_set final
+{
+public:
+    /// Returns the id of `text`, which is inserted if it isn't in the set already.
+    std::uint32_t insert(const char* text, std::size_t size);
+    /// Returns the id of `text`, or `npos` if it isn't in the set.
+    std::uint32_t find(const char* text, std::size_t size) const;
+    const char* data(std::uint32_t id) const;
+    std::size_t size(std::uint32_t id) const;
+    std::size_t count() const;
+
+    static constexpr std::uint32_t npos = std::numeric_limits<std::uint32_t>::max();
+
+private:
+    struct slot final
+    {
+        std::uint64_t hash;
+        std::uint32_t id; // `npos` for empty slots
+    };
+
+    std::size_t probe(std::uint64_t hash, const char* text, std::size_t size) const;
+    void grow();
+
+    std::string texts; // Not a `small_string`, which would allocate from the resource of the calling thread
+    std::vector<std::size_t> ends; // End offset of each text in `texts`
+    std::vector<slot> slots;
+};
+
+} // namespace detail
+
+struct interned_output;
+
+/// Table of quoted property names and short formatted values, each stored once, that `interned_output` refers
+/// to by id. A property name is quoted and escaped only the first time it's seen. The table can be shared by
+/// many outputs, also on different threads, since it's synchronized. Texts are never removed from the table,
+/// so it stops growing at `max_texts` texts, and outputs store the texts that aren't in it themselves.
+class intern_table final
+{
+public:
+    /// Formatted values of up to this number of bytes are interned, and longer ones stored by the output.
+    static constexpr std::size_t max_value_size = 24;
+    /// Returned for texts that aren't in the table when it's full.
+    static constexpr std::uint32_t npos = detail::text_set::npos;
+
+    explicit intern_table(std::size_t max_texts = 65536);
+
+    std::uint32_t intern(const char* text, std::size_t size);
+    std::uint32_t intern_name(const std::string& name);
+    std::size_t size() const; // Number of interned texts
+
+private:
+    friend std::ostream& operator<<(std::ostream& stream, const interned_output& output);
+
+    std::uint32_t insert(const char* text, std::size_t size);
+
+    std::size_t max_texts;
+    mutable std::mutex mutex;
+    detail::text_set texts;
+    detail::text_set names;            // Unquoted names that have been interned
+    std::vector<std::uint32_t> quoted; // Id in `texts` of the quoted name, per id in `names`
+};
+
+/// A table for outputs to share, by passing it to their constructors.
+intern_table& global_intern_table();
+
+/// Output for state that repeats the same property names and values, like the same properties of snapshots
+/// added on every step. An entry only stores the ids of its interned name and value, 8 bytes, so repeated
+/// names and short values cost a table lookup instead of an allocation and a copy of their text. Values
+/// longer than `intern_table::max_value_size` are stored by the output, since they're rarely repeated.
+/// An output has a table of its own, which is released with it, unless it's given one to share.
+struct interned_output final
+{
+    explicit interned_output(prefix_string prefix = {});
+    explicit interned_output(intern_table& table, prefix_string prefix = {});
+
+    template <typename T>
+    interned_output& add(const T& value);
+    template <typename T>
+    interned_output& add(const std::string& name, const T& value);
+
+    struct entry final
+    {
+        std::uint32_t name;  // `no_name` for values
+        std::uint32_t value; // The id in `table`, or the index in `literals` with `literal_bit` set
+    };
+
+    static constexpr std::uint32_t no_name = std::numeric_limits<std::uint32_t>::max();
+    static constexpr std::uint32_t literal_bit = std::uint32_t{1} << 31;
+
+    std::unique_ptr<intern_table> own_table; // Null for outputs that are given a table
+    intern_table* table;
+    prefix_string prefix;
+    std::vector<entry> entries;
+    detail::text_set literals; // Values that are too long to intern in `table`
+    detail::small_string scratch;
+};
+
+std::ostream& operator<<(std::ostream& stream, const interned_output& output);
+interned_output& operator+=(interned_output& output, const value& value);
+interned_output& operator+=(interned_output& output, const property& property);
+
+// Implementation below this line
+
+namespace detail {
+
+small_string quote(const std::string& text);
+void begin_entry(small_string& buffer, const prefix_string& prefix);
+#if defined(JG_TEST_STATE_STATS)
+std::uint64_t count_entries(const small_string& text);
+#endif
+void limit_entry(small_string& buffer, std::size_t entry_begin, std::size_t& omitted_bytes);
+std::size_t omitted_chars(std::size_t count);
+void append_omitted(small_string& buffer, std::size_t count);
+void append_string(small_string& buffer, const char* text, std::size_t size);
+void append_string(small_string& buffer, const char* text, std::size_t size, std::size_t omitted);
+void append_quoted(small_string& buffer, const std::string& text);
+void append_quoted(small_string& buffer, const char* text, std::size_t size);
+void append_escaped(small_string& buffer, const char* text, std::size_t size);
+std::size_t unescaped_length(const char* text, std::size_t size);
+void format_property(small_string& buffer, const std::string& name, const small_string& value);
+bool prepend_in_place(small_string& text, const char* head, std::size_t size);
+bool prepend_name(small_string& text, const std::string& name);
+void add_entry(output& output, const small_string& text);
+void add_entry(output& output, small_string&& text);
+
+template <typename T>
+void format_value(small_string& buffer, const T& value);
+void format_value(small_string& buffer, const std::string& value);
+template <typename T>
+void format_value(small_string& buffer, T* value);
+template <typename T>
+void format_value(small_string& buffer, const T* value);
+void format_value(small_string& buffer, std::nullptr_t);
+void format_value(small_string& buffer, char* value);
+void format_value(small_string& buffer, const char* value);
+void format_value(small_string& buffer, bool value);
+void format_value(small_string& buffer, const value& value);
+void format_value(small_string& buffer, const property& property);
+template <typename T>
+void format_value(small_string& buffer, const deferred_property<T>& property);
+
+/// Text that `format_value` appends as is, and text that it formats as a string value.
+struct text_span final
+{
+    const char* data;
+    std::size_t size;
+};
+
+struct string_span final
+{
+    const char* data;
+    std::size_t size;
+};
+
+void format_value(small_string& buffer, const text_span& text);
+void format_value(small_string& buffer, const string_span& text);
+
+// Pairs and tuples are formatted as arrays, optional values as their value or null, and variants as their
+// active alternative, without going through `std::ostream`.
+template <typename T1, typename T2>
+void format_value(small_string& buffer, const std::pair<T1, T2>& pair);
+template <typename... T>
+void format_value(small_string& buffer, const std::tuple<T...>& tuple);
+#if defined(JG_TEST_STATE_OPTIONAL_VARIANT)
+template <typename T>
+void format_value(small_string& buffer, const std::optional<T>& optional);
+void format_value(small_string& buffer, std::nullopt_t);
+template <typename... T>
+void format_value(small_string& buffer, const std::variant<T...>& variant);
+void format_value(small_string& buffer, std::monostate);
+#endif
+
+template <typename T>
+struct is_number : std::integral_constant<bool,
+    std::is_arithmetic<T>::value && !std::is_same<T, char>::value && !std::is_same<T, signed char>::value &&
+    !std::is_same<T, unsigned char>::value && !std::is_same<T, wchar_t>::value &&
+    !std::is_same<T, char16_t>::value && !std::is_same<T, char32_t>::value> {};
+
+template <typename TIterator, bool = is_number<typename std::iterator_traits<TIterator>::value_type>::value>
+struct is_contiguous_number_iterator : std::false_type {};
+
+template <typename T>
+struct is_contiguous_number_iterator<T*, true> : std::true_type {};
+
+// Iterators of std::vector<bool> aren't contiguous.
+template <typename TIterator>
+struct is_contiguous_number_iterator<TIterator, true> : std::integral_constant<bool,
+    !std::is_same<typename std::iterator_traits<TIterator>::value_type, bool>::value &&
+    (std::is_same<TIterator, typename std::vector<typename std::iterator_traits<TIterator>::value_type>::iterator>::value ||
+     std::is_same<TIterator, typename std::vector<typename std::iterator_traits<TIterator>::value_type>::const_iterator>::value)> {};
+
+template <typename TIterator, typename TSentinel>
+struct is_random_access_range : std::integral_constant<bool, std::is_same<TIterator, TSentinel>::value &&
+    std::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<TIterator>::iterator_category>::value> {};
+
+template <typename TIterator, typename TSentinel>
+std::size_t count_remaining(TIterator first, TSentinel last);
+std::size_t parallel_chunks(std::size_t count);
+template <typename TTask>
+void run_chunks(std::size_t chunks, const TTask& task);
+template <typename TIterator, typename TFormat>
+void format_chunks(small_string& text, TIterator first, std::size_t count, std::size_t chunks, const TFormat& format_element);
+template <typename T>
+void format_element(small_string& buffer, const T& value);
+void format_element(small_string& buffer, const value& value);
+template <typename TIterator, typename TSentinel>
+value format_array(TIterator first_value, TSentinel last_value, std::false_type is_contiguous_number);
+template <typename TIterator, typename TSentinel>
+value format_array(TIterator first_value, TSentinel last_value, std::false_type is_contiguous_number, std::false_type is_random_access);
+template <typename TIterator>
+value format_array(TIterator first_value, TIterator last_value, std::false_type is_contiguous_number, std::true_type is_random_access);
+template <typename TIterator>
+value format_array(TIterator first_value, TIterator last_value, std::true_type is_contiguous_number);
+
+template <typename T>
+struct is_key_value : std::false_type {};
+
+template <typename TKey, typename TValue>
+struct is_key_value<std::pair<TKey, TValue>> : std::true_type {};
+
+template <typename TIterator, typename TSentinel>
+value format_object(TIterator first_property, TSentinel last_property, std::false_type is_key_value);
+template <typename TIterator, typename TSentinel>
+value format_object(TIterator first_pair, TSentinel last_pair, std::true_type is_key_value);
+template <typename TIterator, typename TSentinel>
+value format_object(TIterator first_pair, TSentinel last_pair, std::true_type is_key_value, std::false_type is_random_access);
+template <typename TIterator>
+value format_object(TIterator first_pair, TIterator last_pair, std::true_type is_key_value, std::true_type is_random_access);
+template <typename T>
+void format_key(small_string& buffer, const T& key);
+void format_key(small_string& buffer, const std::string& key);
+void format_key(small_string& buffer, const char* key);
+
+template <typename T>
+void output_value(std::ostream& stream, const T& value);
+void output_value(std::ostream& stream, const std::string& value);
+template <typename T>
+void output_value(std::ostream& stream, T* value);
+template <typename T>
+void output_value(std::ostream& stream, const T* value);
+void output_value(std::ostream& stream, std::nullptr_t);
+void output_value(std::ostream& stream, char* value);
+void output_value(std::ostream& stream, const char* value);
+void output_value(std::ostream& stream, bool value);
+
+} // namespace detail
+
+inline value::value(formatted_string formatted)
+    : formatted{std::move(formatted)}
+{}
+
+template <typename T>
+value::value(const T& value)
+{
+    static_assert(!std::is_same<property, T>::value, "A 'value' cannot be constructed from a 'property'");
+    static_assert(!std::is_same<prefix_string, T>::value, "A 'value' cannot be constructed from a 'prefix_string'");
+    static_assert(!std::is_same<formatted_string, T>::value, "A 'value' cannot be constructed from a 'formatted_string'");
+    JG_TEST_STATE_FORMATTING(formatted.underlying, false);
+    detail::format_value(formatted.underlying, value);
+}
+
+inline std::ostream& operator<<(std::ostream& stream, const value& value)
+{
+    return stream << value.formatted.underlying;
+}
+
+inline value object(const property& property)
+{
+    builder builder;
+    builder.begin_object().property(property).end_object();
+    return builder.release();
+}
+
+// Properties have room for the brackets, unless their text was moved from a value, so the object is usually
+// made in place.
+inline value object(property&& property)
+{
+    auto& text = property.formatted.underlying;
+    if (text.capacity() - text.size() < 4)
+        return object(static_cast<const test_state::property&>(property));
+    text.insert(0, "{ ", 2);
+    text += " }";
+    return value{formatted_string{std::move(text)}};
+}
+
+inline value object(std::initializer_list<property> properties)
+{
+    return object(properties.begin(), properties.end());
+}
+
+template <typename TIterator, typename TSentinel>
+value object(TIterator first_property, TSentinel last_property)
+{
+    using element = typename std::iterator_traits<TIterator>::value_type;
+    static_assert(std::is_same<property, element>::value || detail::is_key_value<element>::value, "Invalid 'property' or key/value pair iterator");
+    return detail::format_object(first_property, last_property, detail::is_key_value<element>{});
+}
+
+template <typename TRange>
+value object(const TRange& properties)
+{
+    return object(std::begin(properties), std::end(properties));
+}
+
+inline value array(std::initializer_list<value> values)
+{
+    return array(values.begin(), values.end());
+}
+
+template <typename TIterator, typename TSentinel>
+value array(TIterator first_value, TSentinel last_value)
+{
+    return detail::format_array(first_value, last_value, std::integral_constant<bool,
+        std::is_same<TIterator, TSentinel>::value && detail::is_contiguous_number_iterator<TIterator>::value>{});
+}
+
+template <typename TRange>
+value array(const TRange& values)
+{
+    return array(std::begin(values), std::end(values));
+}
+
+inline property::property(const std::string& name, const value& value)
+{
+    detail::format_property(formatted.underlying, name, value.formatted.underlying);
+}
+
+inline property::property(const std::string& name, value&& value)
+{
+    auto& text = value.formatted.underlying;
+    if (detail::prepend_name(text, name))
+        formatted.underlying = std::move(text);
+    else
+        detail::format_property(formatted.underlying, name, text);
+}
+
+inline std::ostream& operator<<(std::ostream& stream, const property& property)
+{
+    return stream << property.formatted.underlying;
+}
+
+inline builder::builder(output& output)
+    : target{&output}
+{}
+
+inline builder& builder::begin_object()
+{
+    begin_element();
+    buffer() += '{';
+    levels.push_back(false);
+    return *this;
+}
+
+inline builder& builder::end_object()
+{
+    end_level('}');
+    return *this;
+}
+
+inline builder& builder::begin_array()
+{
+    begin_element();
+    buffer() += '[';
+    levels.push_back(false);
+    return *this;
+}
+
+inline builder& builder::end_array()
+{
+    end_level(']');
+    return *this;
+}
+
+inline builder& builder::key(const std::string& name)
+{
+    begin_element();
+    detail::append_quoted(buffer(), name);
+    buffer() += ": ";
+    keyed = true;
+    return *this;
+}
+
+template <typename T>
+builder& builder::value(const T& value)
+{
+    begin_element();
+    {
+        JG_TEST_STATE_FORMATTING(buffer(), false);
+        detail::format_value(buffer(), value);
+    }
+    end_element();
+    return *this;
+}
+
+inline builder& builder::value(const test_state::value& value)
+{
+    begin_element();
+    buffer() += value.formatted.underlying;
+    end_element();
+    return *this;
+}
+
+inline builder& builder::property(const test_state::property& property)
+{
+    begin_element();
+    buffer() += property.formatted.underlying;
+    end_element();
+    return *this;
+}
+
+inline builder& builder::omitted(std::size_t count)
+{
+    begin_element();
+    detail::append_omitted(buffer(), count);
+    end_element();
+    return *this;
+}
+
+inline value builder::release()
+{
+    assert(levels.empty());
+    levels.clear();
+    keyed = false;
+    return test_state::value{formatted_string{std::move(owned)}};
+}
+
+inline detail::small_string& builder::buffer()
+{
+    return target ? target->formatted.underlying : owned;
+}
+
+inline void builder::begin_element()
+{
+    auto& text = buffer();
+    if (keyed) {
+        keyed = false;
+    } else if (levels.empty()) {
+        entry_begin = text.size();
+        if (target)
+            detail::begin_entry(text, target->prefix);
+        else if (!text.empty())
+            text += '\n';
+    } else {
+        text += levels.back() ? ", " : " ";
+        levels.set_back(true);
+    }
+}
+
+// Top-level elements written to an output are entries of that output, which are subject to its byte budget.
+inline void builder::end_element()
+{
+    if (target && levels.empty() && !keyed)
+        detail::limit_entry(target->formatted.underlying, entry_begin, target->omitted_bytes);
+}
+
+inline void builder::end_level(char bracket)
+{
+    auto& text = buffer();
+    if (levels.back())
+        text += ' ';
+    text += bracket;
+    levels.pop_back();
+    end_element();
+}
+
+inline settings& global_settings()
+{
+    static settings instance;
+    return instance;
+}
+
+inline prefix_string google_test_prefix()
+{
+    return prefix_string{"[    STATE ] "};
+}
+
+inline output::output(prefix_string prefix)
+    : prefix{std::move(prefix)}
+{}
+
+inline output::output(const value& value)
+{
+    *this += value;
+}
+
+inline output::output(value&& value)
+{
+    *this += std::move(value);
+}
+
+inline output::output(const property& property)
+{
+    *this += property;
+}
+
+inline output::output(property&& property)
+{
+    *this += std::move(property);
+}
+
+inline output::output(prefix_string prefix, const property& property)
+    : prefix{std::move(prefix)}
+{
+    *this += property;
+}
+
+inline output::output(prefix_string prefix, property&& property)
+    : prefix{std::move(prefix)}
+{
+    *this += std::move(property);
+}
+
+inline output::output(prefix_string prefix, const value& value)
+    : prefix{std::move(prefix)}
+{
+    *this += value;
+}
+
+inline output::output(prefix_string prefix, value&& value)
+    : prefix{std::move(prefix)}
+{
+    *this += std::move(value);
+}
+
+inline std::ostream& operator<<(std::ostream& stream, const output& output)
+{
+    JG_TEST_STATE_COUNT(streamed_entries, detail::count_entries(output.formatted.underlying));
+    return stream << output.formatted.underlying;
+}
+
+inline output& operator+=(output& output, const property& property)
+{
+    detail::add_entry(output, property.formatted.underlying);
+    return output;
+}
+
+inline output& operator+=(output& output, property&& property)
+{
+    detail::add_entry(output, std::move(property.formatted.underlying));
+    return output;
+}
+
+inline output& operator+=(output& output, const value& value)
+{
+    detail::add_entry(output, value.formatted.underlying);
+    return output;
+}
+
+inline output& operator+=(output& output, value&& value)
+{
+    detail::add_entry(output, std::move(value.formatted.underlying));
+    return output;
+}
+
+namespace detail {
+
+template <typename T>
+struct capture_type
+{
+    using type = typename std::decay<T>::type;
+};
+
+template <>
+struct capture_type<char*>
+{
+    using type = std::string;
+};
+
+template <>
+struct capture_type<const char*>
+{
+    using type = std::string;
+};
+
+template <typename T>
+using capture_type_t = typename capture_type<typename std::decay<T>::type>::type;
+
+template <typename T>
+captured_value::captured_value(T&& value)
+{
+    using stored = capture_type_t<T>;
+    emplace<stored>(std::forward<T>(value), std::integral_constant<bool,
+        sizeof(stored) <= inline_size && alignof(stored) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible<stored>::value>{});
+}
+
+template <typename TStored, typename T>
+void captured_value::emplace(T&& value, std::true_type /*fits_inline*/)
+{
+    new (storage) TStored(std::forward<T>(value));
+    ops = inline_operations<TStored>();
+}
+
+template <typename TStored, typename T>
+void captured_value::emplace(T&& value, std::false_type /*fits_inline*/)
+{
+    new (storage) TStored*(new TStored(std::forward<T>(value)));
+    ops = heap_operations<TStored>();
+}
+
+inline captured_value::captured_value(captured_value&& other) noexcept
+    : ops{other.ops}
+{
+    ops->move(other.storage, storage);
+}
+
+inline captured_value::~captured_value()
+{
+    ops->destroy(storage);
+}
+
+inline void captured_value::format(small_string& buffer) const
+{
+    ops->format(storage, buffer);
+}
+
+template <typename T>
+auto captured_value::inline_operations() -> const operations*
+{
+    static const operations ops {
+        [](const void* value, small_string& buffer) { format_value(buffer, *static_cast<const T*>(value)); },
+        [](void* from, void* to) { new (to) T(std::move(*static_cast<T*>(from))); },
+        [](void* value) { static_cast<T*>(value)->~T(); }
+    };
+    return &ops;
+}
+
+template <typename T>
+auto captured_value::heap_operations() -> const operations*
+{
+    static const operations ops {
+        [](const void* value, small_string& buffer) { format_value(buffer, **static_cast<T* const*>(value)); },
+        [](void* from, void* to) { new (to) T*(*static_cast<T**>(from)); *static_cast<T**>(from) = nullptr; },
+        [](void* value) { delete *static_cast<T**>(value); }
+    };
+    return &ops;
+}
+
+} // namespace detail
+
+inline deferred_output::deferred_output(prefix_string prefix)
+    : prefix{std::move(prefix)}
+{}
+
+template <typename T>
+deferred_output& deferred_output::add(T&& value)
+{
+    static_assert(!std::is_same<prefix_string, typename std::decay<T>::type>::value, "A 'prefix_string' cannot be added to 'deferred_output'");
+    static_assert(!std::is_same<formatted_string, typename std::decay<T>::type>::value, "A 'formatted_string' cannot be added to 'deferred_output'");
+    captured.emplace_back(std::forward<T>(value));
+    JG_TEST_STATE_COUNT(appended_entries, 1);
+    return *this;
+}
+
+template <typename T>
+deferred_output& deferred_output::add(std::string name, T&& value)
+{
+    captured.emplace_back(detail::deferred_property<detail::capture_type_t<T>>{std::move(name), std::forward<T>(value)});
+    JG_TEST_STATE_COUNT(appended_entries, 1);
+    return *this;
+}
+
+inline std::ostream& operator<<(std::ostream& stream, const deferred_output& output)
+{
+    for (; output.formatted_count < output.captured.size(); ++output.formatted_count) {
+        const auto entry_begin = output.formatted.underlying.size();
+        detail::begin_entry(output.formatted.underlying, output.prefix);
+        {
+            JG_TEST_STATE_FORMATTING(output.formatted.underlying, false);
+            output.captured[output.formatted_count].format(output.formatted.underlying);
+        }
+        detail::limit_entry(output.formatted.underlying, entry_begin, output.omitted_bytes);
+    }
+    JG_TEST_STATE_COUNT(streamed_entries, output.captured.size());
+    return stream << output.formatted.underlying;
+}
+
+template <typename T>
+deferred_output& operator+=(deferred_output& output, T&& value)
+{
+    return output.add(std::forward<T>(value));
+}
+
+inline deferred_output& operator+=(deferred_output& output, const property& property)
+{
+    return output.add(property);
+}
+
+inline sink_output::sink_output(std::ostream& stream, prefix_string prefix, std::size_t batch_size)
+    : sink_output{[&stream](const char* data, std::size_t size) {
+                      stream.write(data, static_cast<std::streamsize>(size));
+                      stream.flush();
+                  }, std::move(prefix), batch_size}
+{}
+
+inline sink_output::sink_output(std::FILE* file, prefix_string prefix, std::size_t batch_size)
+    : sink_output{[file](const char* data, std::size_t size) {
+                      std::fwrite(data, 1, size, file);
+                      std::fflush(file);
+                  }, std::move(prefix), batch_size}
+{}
+
+inline sink_output::sink_output(file_descriptor descriptor, prefix_string prefix, std::size_t batch_size)
+    : sink_output{[descriptor](const char* data, std::size_t size) {
+                      while (size > 0) {
+#if defined(_WIN32)
+                          const auto written = _write(descriptor.underlying, data, static_cast<unsigned>(size));
+#else
+                          const auto written = ::write(descriptor.underlying, data, size);
+#endif
+                          if (written < 0) {
+                              if (errno == EINTR)
+                                  continue;
+                              return;
+                          }
+                          data += written;
+                          size -= static_cast<std::size_t>(written);
+                      }
+                  }, std::move(prefix), batch_size}
+{}
+
+inline sink_output::sink_output(write_function write, prefix_string prefix, std::size_t batch_size)
+    : prefix{std::move(prefix)}
+    , write{std::move(write)}
+    , batch_size{batch_size}
+{
+    pending.reserve(batch_size);
+}
+
+inline sink_output::~sink_output()
+{
+    try {
+        flush();
+    } catch (...) {
+    }
+}
+
+template <typename T>
+sink_output& sink_output::add(const T& value)
+{
+    {
+        JG_TEST_STATE_FORMATTING(pending, true);
+        pending += prefix.underlying;
+        detail::format_value(pending, value);
+        pending += '\n';
+    }
+    if (pending.size() >= batch_size)
+        flush();
+    return *this;
+}
+
+template <typename T>
+sink_output& sink_output::add(const std::string& name, const T& value)
+{
+    {
+        JG_TEST_STATE_FORMATTING(pending, true);
+        pending += prefix.underlying;
+        detail::append_quoted(pending, name);
+        pending += ": ";
+        detail::format_value(pending, value);
+        pending += '\n';
+    }
+    if (pending.size() >= batch_size)
+        flush();
+    return *this;
+}
+
+inline void sink_output::flush()
+{
+    if (pending.empty())
+        return;
+    write(pending.data(), pending.size());
+    pending.clear();
+}
+
+inline sink_output& operator+=(sink_output& output, const value& value)
+{
+    return output.add(value);
+}
+
+inline sink_output& operator+=(sink_output& output, const property& property)
+{
+    return output.add(property);
+}
+
+namespace detail {
+
+inline std::uint64_t next_output_id()
+{
+    static std::atomic<std::uint64_t> id{};
+    return ++id;
+}
+
+// Returns the shard of the calling thread, via a per-thread cache of the shards used most recently. Output
+// ids are never reused, so cached shards of destroyed outputs are never found again.
+inline output_shard& thread_shard(concurrent_output& output)
+{
+    struct cached_shard final
+    {
+        std::uint64_t id;
+        output_shard* shard;
+    };
+    constexpr std::size_t max_cached_shards = 16;
+    thread_local std::vector<cached_shard> cache;
+
+    for (const auto& cached : cache)
+        if (cached.id == output.id)
+            return *cached.shard;
+
+    output_shard* shard = nullptr;
+    {
+        const auto thread = std::this_thread::get_id();
+        std::lock_guard<std::mutex> lock{output.shards_mutex};
+        // A thread can only have the id of a thread that has ended, so taking over its shard is safe.
+        for (const auto& existing : output.shards)
+            if (existing->owner == thread)
+                shard = existing.get();
+        if (!shard) {
+            output.shards.push_back(std::make_unique<output_shard>());
+            shard = output.shards.back().get();
+            shard->owner = thread;
+        }
+    }
+
+    if (cache.size() == max_cached_shards)
+        cache.erase(cache.begin());
+    cache.push_back({output.id, shard});
+    return *shard;
+}
+
+// Stamps the entry that was just appended to `shard` at `entry_begin` with a sequence number, or drops it if
+// the shards already hold `settings::max_output_bytes`. The bytes aren't counted without a budget, which
+// saves contending for them.
+inline void end_shard_entry(concurrent_output& output, output_shard& shard, std::size_t entry_begin)
+{
+    const auto max_output_bytes = global_settings().max_output_bytes;
+    const auto size = shard.text.size() - entry_begin + output.prefix.underlying.size() + 1;
+    if (max_output_bytes == std::numeric_limits<std::size_t>::max() ||
+        output.bytes.fetch_add(size, std::memory_order_relaxed) < max_output_bytes) {
+        shard.entries.push_back({output.sequence.fetch_add(1, std::memory_order_relaxed), shard.text.size()});
+    } else {
+        shard.text.resize(entry_begin);
+        shard.omitted_bytes += size;
+    }
+}
+
+} // namespace detail
+
+inline concurrent_output::concurrent_output()
+    : id{detail::next_output_id()}
+{}
+
+inline concurrent_output::concurrent_output(prefix_string prefix)
+    : prefix{std::move(prefix)}
+    , id{detail::next_output_id()}
+{}
+
+template <typename T>
+concurrent_output& concurrent_output::add(const T& value)
+{
+    auto& shard = detail::thread_shard(*this);
+    const auto entry_begin = shard.text.size();
+    JG_TEST_STATE_FORMATTING(shard.text, true);
+    detail::format_value(shard.text, value);
+    detail::end_shard_entry(*this, shard, entry_begin);
+    return *this;
+}
+
+template <typename T>
+concurrent_output& concurrent_output::add(const std::string& name, const T& value)
+{
+    auto& shard = detail::thread_shard(*this);
+    const auto entry_begin = shard.text.size();
+    JG_TEST_STATE_FORMATTING(shard.text, true);
+    detail::append_quoted(shard.text, name);
+    shard.text += ": ";
+    detail::format_value(shard.text, value);
+    detail::end_shard_entry(*this, shard, entry_begin);
+    return *this;
+}
+
+// The sequence numbers of all entries are unique and dense, so the entries are merged by placing each one at
+// the index of its sequence number, in linear time.
+inline std::ostream& operator<<(std::ostream& stream, const concurrent_output& output)
+{
+    struct entry_text final
+    {
+        const char* data;
+        std::size_t size;
+    };
+    std::vector<entry_text> ordered(output.sequence.load());
+    std::size_t dropped_bytes = 0;
+
+    for (const auto& shard : output.shards) {
+        std::size_t begin = 0;
+        for (const auto& entry : shard->entries) {
+            if (entry.sequence < ordered.size())
+                ordered[entry.sequence] = {shard->text.data() + begin, entry.end - begin};
+            begin = entry.end;
+        }
+        dropped_bytes += shard->omitted_bytes;
+    }
+
+    // The shards can hold a little more than `settings::max_output_bytes`, since each thread checks the bytes
+    // of all shards before adding its entry, so the merged entries are limited like those of an `output`.
+    detail::small_string text;
+    std::size_t omitted_bytes = 0;
+    for (const auto& entry : ordered) {
+        if (!entry.data)
+            continue;
+        JG_TEST_STATE_COUNT(streamed_entries, 1);
+        const auto entry_begin = text.size();
+        detail::begin_entry(text, output.prefix);
+        text.append(entry.data, entry.size);
+        detail::limit_entry(text, entry_begin, omitted_bytes);
+    }
+    if (dropped_bytes > 0) {
+        if (omitted_bytes > 0)
+            text.resize(text.size() - detail::omitted_chars(omitted_bytes));
+        detail::append_omitted(text, omitted_bytes + dropped_bytes);
+    }
+    return stream << text;
+}
+
+inline concurrent_output& operator+=(concurrent_output& output, const value& value)
+{
+    return output.add(value);
+}
+
+inline concurrent_output& operator+=(concurrent_output& output, const property& property)
+{
+    return output.add(property);
+}
+
+namespace detail {
+
+/// Stream buffer that appends everything written to it to a target string, via a small put area.
+class string_appender final : public std::streambuf
+{
+public:
+    string_appender()
+    {
+        setp(area, area + sizeof(area));
+    }
+
+    void attach(small_string& buffer)
+    {
+        target = &buffer;
+    }
+
+    void detach()
+    {
+        flush();
+        target = nullptr;
+    }
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        flush();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char* text, std::streamsize size) override
+    {
+        flush();
+        target->append(text, static_cast<std::size_t>(size));
+        return size;
+    }
+
+    int sync() override
+    {
+        flush();
+        return 0;
+    }
+
+private:
+    void flush()
+    {
+        target->append(pbase(), pptr());
+        setp(area, area + sizeof(area));
+    }
+
+    char area[256];
+    small_string* target{};
+};
+
+struct pooled_stream final
+{
+    pooled_stream()
+        : stream{&appender}
+    {
+        stream.imbue(std::locale::classic());
+    }
+
+    string_appender appender;
+    std::ostream stream;
+};
+
+inline std::vector<std::unique_ptr<pooled_stream>>& stream_pool()
+{
+    thread_local std::vector<std::unique_ptr<pooled_stream>> pool;
+    return pool;
+}
+
+/// Leases a stream from the per-thread pool, appending to `buffer`, and returns it to the pool when the lease
+/// ends. A stream output operator that formats nested values leases further streams from the same pool.
+class stream_lease final
+{
+public:
+    explicit stream_lease(small_string& buffer)
+    {
+        auto& pool = stream_pool();
+        if (pool.empty()) {
+            leased = std::make_unique<pooled_stream>();
+        } else {
+            leased = std::move(pool.back());
+            pool.pop_back();
+        }
+
+        std::ostream& stream = leased->stream;
+        stream.clear();
+        stream.flags(std::ios_base::skipws | std::ios_base::dec);
+        stream.precision(6);
+        stream.width(0);
+        stream.fill(' ');
+        if (stream.getloc() != std::locale::classic())
+            stream.imbue(std::locale::classic());
+        leased->appender.attach(buffer);
+    }
+
+    stream_lease(const stream_lease&) = delete;
+    stream_lease& operator=(const stream_lease&) = delete;
+
+    ~stream_lease()
+    {
+        leased->appender.detach();
+        stream_pool().push_back(std::move(leased));
+    }
+
+    std::ostream& stream()
+    {
+        return leased->stream;
+    }
+
+private:
+    std::unique_ptr<pooled_stream> leased;
+};
+
+/// Formatting kinds that `format_value` dispatches on. Integers, floating point values and characters are
+/// formatted without going through `std::ostream`, and all other types use their stream output operator.
+struct stream_kind final {};
+struct integer_kind final {};
+struct floating_point_kind final {};
+struct character_kind final {};
+
+template <typename T>
+struct is_character : std::integral_constant<bool,
+    std::is_same<T, char>::value || std::is_same<T, signed char>::value || std::is_same<T, unsigned char>::value> {};
+
+template <typename T>
+using format_kind = typename std::conditional<is_character<T>::value, character_kind,
+                    typename std::conditional<std::is_integral<T>::value && !std::is_same<T, bool>::value &&
+                                              !std::is_same<T, wchar_t>::value && !std::is_same<T, char16_t>::value &&
+                                              !std::is_same<T, char32_t>::value, integer_kind,
+                    typename std::conditional<std::is_floating_point<T>::value, floating_point_kind,
+                    stream_kind>::type>::type>::type;
+
+/// Upper bounds of the number of characters written by the `write_...` functions below.
+constexpr std::size_t max_integer_chars = 21; // 20 digits of 2^64 - 1 plus sign
+constexpr std::size_t max_floating_point_chars = 64;
+constexpr std::size_t max_pointer_chars = 2 + sizeof(void*) * 2; // "0x" and two hex chars per byte
+
+inline unsigned digit_count(unsigned long long value)
+{
+    unsigned count = 1;
+    for (;;) {
+        if (value < 10) return count;
+        if (value < 100) return count + 1;
+        if (value < 1000) return count + 2;
+        if (value < 10000) return count + 3;
+        value /= 10000;
+        count += 4;
+    }
+}
+
+inline char* write_unsigned(char* out, unsigned long long value)
+{
+    static const char digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+    char* const end = out + digit_count(value);
+    char* it = end;
+    while (value >= 100) {
+        const auto pair = static_cast<std::size_t>(value % 100) * 2;
+        value /= 100;
+        *--it = digit_pairs[pair + 1];
+        *--it = digit_pairs[pair];
+    }
+    if (value >= 10) {
+        const auto pair = static_cast<std::size_t>(value) * 2;
+        *--it = digit_pairs[pair + 1];
+        *--it = digit_pairs[pair];
+    } else {
+        *--it = static_cast<char>('0' + value);
+    }
+    return end;
+}
+
+template <typename T>
+char* write_integer(char* out, T value, std::true_type /*is_signed*/)
+{
+    const auto magnitude = static_cast<unsigned long long>(value);
+    if (value < 0) {
+        *out++ = '-';
+        return write_unsigned(out, 0ull - magnitude);
+    }
+    return write_unsigned(out, magnitude);
+}
+
+template <typename T>
+char* write_integer(char* out, T value, std::false_type /*is_signed*/)
+{
+    return write_unsigned(out, value);
+}
+
+template <typename T>
+char* write_integer(char* out, T value)
+{
+    return write_integer(out, value, std::is_signed<T>{});
+}
+
+/// Significant digits, without trailing zeros, and decimal exponent of a floating point value.
+struct decimal_digits final
+{
+    char digits[max_floating_point_chars];
+    int count;
+    int exponent;
+};
+
+// Reads the digits and the exponent of text in scientific notation, like "1.2500e+03" from "%e" or
+// `std::to_chars`. The decimal point isn't read, so it can be that of any locale.
+inline void read_scientific(const char* text, decimal_digits& decimal)
+{
+    decimal.count = 0;
+    for (; *text != 'e'; ++text)
+        if (*text >= '0' && *text <= '9')
+            decimal.digits[decimal.count++] = *text;
+    while (decimal.count > 1 && decimal.digits[decimal.count - 1] == '0')
+        --decimal.count;
+
+    const bool negative = *++text == '-';
+    int exponent = 0;
+    for (++text; *text >= '0' && *text <= '9'; ++text)
+        exponent = exponent * 10 + (*text - '0');
+    decimal.exponent = negative ? -exponent : exponent;
+}
+
+// Writes the digits in fixed notation for exponents from -4 up to `scientific_exponent`, and in scientific
+// notation with at least two exponent digits otherwise.
+inline char* write_decimal(char* out, const decimal_digits& decimal, int scientific_exponent)
+{
+    const auto* const digits = decimal.digits;
+    const auto count = static_cast<std::size_t>(decimal.count);
+    const auto exponent = decimal.exponent;
+
+    if (exponent < -4 || exponent >= scientific_exponent) {
+        *out++ = digits[0];
+        if (count > 1) {
+            *out++ = '.';
+            std::memcpy(out, digits + 1, count - 1);
+            out += count - 1;
+        }
+        *out++ = 'e';
+        *out++ = exponent < 0 ? '-' : '+';
+        const auto magnitude = static_cast<unsigned>(exponent < 0 ? -exponent : exponent);
+        if (magnitude < 10)
+            *out++ = '0';
+        return write_unsigned(out, magnitude);
+    }
+
+    if (exponent < 0) {
+        const auto zeros = static_cast<std::size_t>(-exponent - 1);
+        std::memcpy(out, "0.000", 2 + zeros);
+        out += 2 + zeros;
+        std::memcpy(out, digits, count);
+        return out + count;
+    }
+
+    const auto integral = static_cast<std::size_t>(exponent) + 1;
+    if (count <= integral) {
+        std::memcpy(out, digits, count);
+        std::memset(out + count, '0', integral - count);
+        return out + integral;
+    }
+    std::memcpy(out, digits, integral);
+    out[integral] = '.';
+    std::memcpy(out + integral + 1, digits + integral, count - integral);
+    return out + count + 1;
+}
+
+inline int print_scientific(char* out, int precision, double value)
+{
+    return std::snprintf(out, max_floating_point_chars, "%.*e", precision - 1, value);
+}
+
+inline int print_scientific(char* out, int precision, long double value)
+{
+    return std::snprintf(out, max_floating_point_chars, "%.*Le", precision - 1, value);
+}
+
+inline int print_hex(char* out, long double value)
+{
+    return std::snprintf(out, max_floating_point_chars, "%La", value);
+}
+
+inline bool reads_back(const char* text, float value) { return std::strtof(text, nullptr) == value; }
+inline bool reads_back(const char* text, double value) { return std::strtod(text, nullptr) == value; }
+inline bool reads_back(const char* text, long double value) { return std::strtold(text, nullptr) == value; }
+
+// Grisu3, from Florian Loitsch's "Printing Floating-Point Numbers Quickly and Accurately with Integers", finds
+// the shortest digits that read back as a float or double using 64-bit integer arithmetic only. When those
+// digits aren't also the closest ones to the value, which happens for about 0.5% of the values, it gives up
+// and `shortest_digits()` falls back to a search.
+
+/// `significand * 2^exponent`.
+struct diy_fp final
+{
+    std::uint64_t significand;
+    int exponent;
+};
+
+// Returns the upper 64 bits of the 128-bit product, rounded.
+inline diy_fp multiply(diy_fp a, diy_fp b)
+{
+    const std::uint64_t mask = 0xffffffffu;
+    const auto a_high = a.significand >> 32;
+    const auto a_low = a.significand & mask;
+    const auto b_high = b.significand >> 32;
+    const auto b_low = b.significand & mask;
+    const auto high_low = a_high * b_low;
+    const auto low_high = a_low * b_high;
+    const auto middle = ((a_low * b_low) >> 32) + (high_low & mask) + (low_high & mask) + (std::uint64_t{1} << 31);
+    return {a_high * b_high + (high_low >> 32) + (low_high >> 32) + (middle >> 32), a.exponent + b.exponent + 64};
+}
+
+inline diy_fp normalize(diy_fp value)
+{
+    while (!(value.significand >> 63)) {
+        value.significand <<= 1;
+        --value.exponent;
+    }
+    return value;
+}
+
+// Returns the cached power of ten, `10^decimal_exponent`, that scales a value with a binary exponent of at
+// least `minimum_exponent` into the range the digit generation needs.
+inline diy_fp cached_power(int minimum_exponent, int& decimal_exponent)
+{
+    struct power final
+    {
+        std::uint64_t significand;
+        std::int16_t binary_exponent;
+        std::int16_t decimal_exponent;
+    };
+    static const power powers[] = {
+        {0xfa8fd5a0081c0288ull, -1220, -348},
+        {0xbaaee17fa23ebf76ull, -1193, -340},
+        {0x8b16fb203055ac76ull, -1166, -332},
+        {0xcf42894a5dce35eaull, -1140, -324},
+        {0x9a6bb0aa55653b2dull, -1113, -316},
+        {0xe61acf033d1a45dfull, -1087, -308},
+        {0xab70fe17c79ac6caull, -1060, -300},
+        {0xff77b1fcbebcdc4full, -1034, -292},
+        {0xbe5691ef416bd60cull, -1007, -284},
+        {0x8dd01fad907ffc3cull, -980, -276},
+        {0xd3515c2831559a83ull, -954, -268},
+        {0x9d71ac8fada6c9b5ull, -927, -260},
+        {0xea9c227723ee8bcbull, -901, -252},
+        {0xaecc49914078536dull, -874, -244},
+        {0x823c12795db6ce57ull, -847, -236},
+        {0xc21094364dfb5637ull, -821, -228},
+        {0x9096ea6f3848984full, -794, -220},
+        {0xd77485cb25823ac7ull, -768, -212},
+        {0xa086cfcd97bf97f4ull, -741, -204},
+        {0xef340a98172aace5ull, -715, -196},
+        {0xb23867fb2a35b28eull, -688, -188},
+        {0x84c8d4dfd2c63f3bull, -661, -180},
+        {0xc5dd44271ad3cdbaull, -635, -172},
+        {0x936b9fcebb25c996ull, -608, -164},
+        {0xdbac6c247d62a584ull, -582, -156},
+        {0xa3ab66580d5fdaf6ull, -555, -148},
+        {0xf3e2f893dec3f126ull, -529, -140},
+        {0xb5b5ada8aaff80b8ull, -502, -132},
+        {0x87625f056c7c4a8bull, -475, -124},
+        {0xc9bcff6034c13053ull, -449, -116},
+        {0x964e858c91ba2655ull, -422, -108},
+        {0xdff9772470297ebdull, -396, -100},
+        {0xa6dfbd9fb8e5b88full, -369, -92},
+        {0xf8a95fcf88747d94ull, -343, -84},
+        {0xb94470938fa89bcfull, -316, -76},
+        {0x8a08f0f8bf0f156bull, -289, -68},
+        {0xcdb02555653131b6ull, -263, -60},
+        {0x993fe2c6d07b7facull, -236, -52},
+        {0xe45c10c42a2b3b06ull, -210, -44},
+        {0xaa242499697392d3ull, -183, -36},
+        {0xfd87b5f28300ca0eull, -157, -28},
+        {0xbce5086492111aebull, -130, -20},
+        {0x8cbccc096f5088ccull, -103, -12},
+        {0xd1b71758e219652cull, -77, -4},
+        {0x9c40000000000000ull, -50, 4},
+        {0xe8d4a51000000000ull, -24, 12},
+        {0xad78ebc5ac620000ull, 3, 20},
+        {0x813f3978f8940984ull, 30, 28},
+        {0xc097ce7bc90715b3ull, 56, 36},
+        {0x8f7e32ce7bea5c70ull, 83, 44},
+        {0xd5d238a4abe98068ull, 109, 52},
+        {0x9f4f2726179a2245ull, 136, 60},
+        {0xed63a231d4c4fb27ull, 162, 68},
+        {0xb0de65388cc8ada8ull, 189, 76},
+        {0x83c7088e1aab65dbull, 216, 84},
+        {0xc45d1df942711d9aull, 242, 92},
+        {0x924d692ca61be758ull, 269, 100},
+        {0xda01ee641a708deaull, 295, 108},
+        {0xa26da3999aef774aull, 322, 116},
+        {0xf209787bb47d6b85ull, 348, 124},
+        {0xb454e4a179dd1877ull, 375, 132},
+        {0x865b86925b9bc5c2ull, 402, 140},
+        {0xc83553c5c8965d3dull, 428, 148},
+        {0x952ab45cfa97a0b3ull, 455, 156},
+        {0xde469fbd99a05fe3ull, 481, 164},
+        {0xa59bc234db398c25ull, 508, 172},
+        {0xf6c69a72a3989f5cull, 534, 180},
+        {0xb7dcbf5354e9beceull, 561, 188},
+        {0x88fcf317f22241e2ull, 588, 196},
+        {0xcc20ce9bd35c78a5ull, 614, 204},
+        {0x98165af37b2153dfull, 641, 212},
+        {0xe2a0b5dc971f303aull, 667, 220},
+        {0xa8d9d1535ce3b396ull, 694, 228},
+        {0xfb9b7cd9a4a7443cull, 720, 236},
+        {0xbb764c4ca7a44410ull, 747, 244},
+        {0x8bab8eefb6409c1aull, 774, 252},
+        {0xd01fef10a657842cull, 800, 260},
+        {0x9b10a4e5e9913129ull, 827, 268},
+        {0xe7109bfba19c0c9dull, 853, 276},
+        {0xac2820d9623bf429ull, 880, 284},
+        {0x80444b5e7aa7cf85ull, 907, 292},
+        {0xbf21e44003acdd2dull, 933, 300},
+        {0x8e679c2f5e44ff8full, 960, 308},
+        {0xd433179d9c8cb841ull, 986, 316},
+        {0x9e19db92b4e31ba9ull, 1013, 324},
+        {0xeb96bf6ebadf77d9ull, 1039, 332},
+        {0xaf87023b9bf0ee6bull, 1066, 340},
+    };
+
+    const auto k = static_cast<int>(std::ceil((minimum_exponent + 63) * 0.30102999566398114));
+    const auto& cached = powers[(348 + k - 1) / 8 + 1];
+    decimal_exponent = cached.decimal_exponent;
+    return {cached.significand, cached.binary_exponent};
+}
+
+// Moves the last digit towards the value while the digits stay inside the unsafe interval, and fails if the
+// result isn't certain to be the closest to the value.
+inline bool round_weed(char* digits, std::size_t count, std::uint64_t distance_too_high_w, std::uint64_t unsafe_interval,
+                       std::uint64_t rest, std::uint64_t ten_kappa, std::uint64_t unit)
+{
+    const auto small_distance = distance_too_high_w - unit;
+    const auto big_distance = distance_too_high_w + unit;
+
+    while (rest < small_distance && unsafe_interval - rest >= ten_kappa
+           && (rest + ten_kappa < small_distance || small_distance - rest >= rest + ten_kappa - small_distance)) {
+        --digits[count - 1];
+        rest += ten_kappa;
+    }
+
+    if (rest < big_distance && unsafe_interval - rest >= ten_kappa
+        && (rest + ten_kappa < big_distance || big_distance - rest > rest + ten_kappa - big_distance))
+        return false;
+
+    return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+}
+
+// Generates the shortest digits inside the scaled boundaries `low` and `high` of the scaled value `w`.
+inline bool generate_digits(diy_fp low, diy_fp w, diy_fp high, decimal_digits& decimal, int& kappa)
+{
+    std::uint64_t unit = 1;
+    const auto too_high = high.significand + unit;
+    auto unsafe_interval = too_high - (low.significand - unit);
+    const auto shift = static_cast<unsigned>(-w.exponent);
+    const auto one = std::uint64_t{1} << shift;
+    auto integrals = static_cast<std::uint32_t>(too_high >> shift);
+    auto fractionals = too_high & (one - 1);
+
+    std::uint32_t divisor = 1;
+    kappa = integrals ? 1 : 0;
+    while (integrals / divisor >= 10) {
+        divisor *= 10;
+        ++kappa;
+    }
+
+    auto* const digits = decimal.digits;
+    std::size_t count = 0;
+    while (kappa > 0) {
+        digits[count++] = static_cast<char>('0' + integrals / divisor);
+        integrals %= divisor;
+        --kappa;
+        const auto rest = (std::uint64_t{integrals} << shift) + fractionals;
+        if (rest < unsafe_interval) {
+            decimal.count = static_cast<int>(count);
+            return round_weed(digits, count, too_high - w.significand, unsafe_interval, rest,
+                              std::uint64_t{divisor} << shift, unit);
+        }
+        divisor /= 10;
+    }
+
+    for (;;) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafe_interval *= 10;
+        digits[count++] = static_cast<char>('0' + (fractionals >> shift));
+        fractionals &= one - 1;
+        --kappa;
+        if (fractionals < unsafe_interval) {
+            decimal.count = static_cast<int>(count);
+            return round_weed(digits, count, (too_high - w.significand) * unit, unsafe_interval, fractionals, one, unit);
+        }
+    }
+}
+
+template <typename Bits, typename T>
+bool fast_shortest_digits(T value, decimal_digits& decimal)
+{
+    constexpr int significand_bits = std::numeric_limits<T>::digits - 1;
+    constexpr int exponent_bias = std::numeric_limits<T>::max_exponent - 1 + significand_bits;
+    constexpr auto hidden_bit = std::uint64_t{1} << significand_bits;
+
+    Bits bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const std::uint64_t fraction = bits & (hidden_bit - 1);
+    const auto biased_exponent = static_cast<int>(bits >> significand_bits);
+
+    if (!fraction && !biased_exponent) {
+        decimal.digits[0] = '0';
+        decimal.count = 1;
+        decimal.exponent = 0;
+        return true;
+    }
+
+    const diy_fp v = biased_exponent ? diy_fp{fraction | hidden_bit, biased_exponent - exponent_bias}
+                                     : diy_fp{fraction, 1 - exponent_bias};
+    const auto w = normalize(v);
+    const auto plus = normalize({(v.significand << 1) + 1, v.exponent - 1});
+    auto minus = !fraction && biased_exponent > 1 ? diy_fp{(v.significand << 2) - 1, v.exponent - 2}
+                                                  : diy_fp{(v.significand << 1) - 1, v.exponent - 1};
+    minus.significand <<= minus.exponent - plus.exponent;
+    minus.exponent = plus.exponent;
+
+    int power_exponent = 0;
+    const auto power = cached_power(-60 - (w.exponent + 64), power_exponent);
+    int kappa = 0;
+    if (!generate_digits(multiply(minus, power), multiply(w, power), multiply(plus, power), decimal, kappa))
+        return false;
+
+    while (decimal.count > 1 && decimal.digits[decimal.count - 1] == '0') {
+        --decimal.count;
+        ++kappa;
+    }
+    decimal.exponent = kappa - power_exponent + decimal.count - 1;
+    return true;
+}
+
+inline bool fast_shortest_digits(float value, decimal_digits& decimal) { return fast_shortest_digits<std::uint32_t>(value, decimal); }
+inline bool fast_shortest_digits(double value, decimal_digits& decimal) { return fast_shortest_digits<std::uint64_t>(value, decimal); }
+inline bool fast_shortest_digits(long double, decimal_digits&) { return false; }
+
+// Finds the fewest significant digits that read back as `value`. A normal value with at most `digits10`
+// significant digits reads back from `digits10` digits with the same digits and trailing zeros, so the search
+// starts there. Subnormal values have fewer significant digits, so the search starts from 1 for them.
+// `std::snprintf()` and `std::strtod()` use the same locale, so the text reads back in any locale.
+template <typename T>
+void shortest_digits(T value, decimal_digits& decimal)
+{
+    char text[max_floating_point_chars];
+#if defined(JG_TEST_STATE_TO_CHARS)
+    *std::to_chars(text, text + sizeof(text) - 1, value, std::chars_format::scientific).ptr = '\0';
+#else
+    if (fast_shortest_digits(value, decimal))
+        return;
+    using widened = typename std::conditional<std::is_same<T, long double>::value, long double, double>::type;
+    const int first_precision = value < std::numeric_limits<T>::min() ? 1 : std::numeric_limits<T>::digits10;
+    for (int precision = first_precision;; ++precision) {
+        print_scientific(text, precision, static_cast<widened>(value));
+        if (precision >= std::numeric_limits<T>::max_digits10 || reads_back(text, value))
+            break;
+    }
+#endif
+    read_scientific(text, decimal);
+}
+
+// Replaces the decimal point of the locale, which can be more than one character, with '.'.
+inline char* copy_hex(char* out, const char* text)
+{
+    for (bool in_point = false; *text; ++text) {
+        const char c = *text;
+        const bool is_hex_char = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || c == 'x' || c == 'p' || c == '+' || c == '-';
+        if (is_hex_char)
+            *out++ = c;
+        else if (!in_point)
+            *out++ = '.';
+        in_point = !is_hex_char;
+    }
+    return out;
+}
+
+// Writes a finite, non-negative double as "0x1.<fraction>p<exponent>", or "0x0.<fraction>p-1022" when it's
+// subnormal, with the fraction in hexadecimal digits and without trailing zeros. Runtimes disagree on the
+// number of digits of "%a", like 0x1p-1 and 0x1.0000000000000p-1, so the digits are written from the bits.
+inline char* write_hex(char* out, double value)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    constexpr int fraction_bits = std::numeric_limits<double>::digits - 1;
+    constexpr auto fraction_mask = (std::uint64_t{1} << fraction_bits) - 1;
+
+    std::uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    auto fraction = bits & fraction_mask;
+    const auto biased_exponent = static_cast<int>(bits >> fraction_bits);
+    constexpr int exponent_bias = std::numeric_limits<double>::max_exponent - 1;
+    const auto exponent = biased_exponent ? biased_exponent - exponent_bias : fraction ? 1 - exponent_bias : 0;
+
+    std::memcpy(out, biased_exponent ? "0x1" : "0x0", 3);
+    out += 3;
+    if (fraction)
+        *out++ = '.';
+    for (; fraction; fraction = (fraction << 4) & fraction_mask)
+        *out++ = hex_digits[fraction >> (fraction_bits - 4)];
+    *out++ = 'p';
+    *out++ = exponent < 0 ? '-' : '+';
+    return write_unsigned(out, static_cast<unsigned>(exponent < 0 ? -exponent : exponent));
+}
+
+inline char* write_hex(char* out, float value)
+{
+    return write_hex(out, static_cast<double>(value));
+}
+
+inline char* write_hex(char* out, long double value)
+{
+    if (std::numeric_limits<long double>::digits == std::numeric_limits<double>::digits)
+        return write_hex(out, static_cast<double>(value));
+    char text[max_floating_point_chars];
+    print_hex(text, value);
+    return copy_hex(out, text);
+}
+
+template <typename T>
+char* write_floating_point(char* out, T value)
+{
+    static_assert(std::is_floating_point<T>::value, "Invalid floating point type");
+    if (std::signbit(value))
+        *out++ = '-';
+    if (std::isnan(value)) {
+        std::memcpy(out, "nan", 3);
+        return out + 3;
+    }
+    if (std::isinf(value)) {
+        std::memcpy(out, "inf", 3);
+        return out + 3;
+    }
+
+    using widened = typename std::conditional<std::is_same<T, long double>::value, long double, double>::type;
+    const auto magnitude = std::fabs(value);
+    const auto& settings = global_settings();
+    char text[max_floating_point_chars];
+    decimal_digits decimal;
+
+    switch (settings.floating_point) {
+    case floating_point_format::precision: {
+        const auto max_precision = static_cast<std::size_t>(std::numeric_limits<T>::max_digits10);
+        const auto precision = static_cast<int>(settings.floating_point_precision < 1 ? 1
+                                              : settings.floating_point_precision > max_precision ? max_precision
+                                              : settings.floating_point_precision);
+        print_scientific(text, precision, static_cast<widened>(magnitude));
+        read_scientific(text, decimal);
+        return write_decimal(out, decimal, precision);
+    }
+    case floating_point_format::hex:
+        return write_hex(out, magnitude);
+    case floating_point_format::shortest:
+        break;
+    }
+    shortest_digits(magnitude, decimal);
+    return write_decimal(out, decimal, 16);
+}
+
+inline char* write_pointer(char* out, const void* value)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+
+    if (!value) {
+        std::memcpy(out, "null", 4);
+        return out + 4;
+    }
+
+    *out++ = '0';
+    *out++ = 'x';
+    auto address = reinterpret_cast<std::uintptr_t>(value);
+    for (auto i = sizeof(void*) * 2; i > 0; --i) {
+        out[i - 1] = hex_digits[address & 0xf];
+        address >>= 4;
+    }
+    return out + sizeof(void*) * 2;
+}
+
+constexpr std::size_t max_omitted_chars = 12 + max_integer_chars;
+
+inline char* write_omitted(char* out, std::size_t count)
+{
+    std::memcpy(out, "... (+", 6);
+    out = write_unsigned(out + 6, count);
+    std::memcpy(out, " more)", 6);
+    return out + 6;
+}
+
+inline std::size_t omitted_chars(std::size_t count)
+{
+    return 12 + digit_count(count);
+}
+
+// Moves `size` back to the start of a UTF-8 sequence, so that text cut at `size` stays valid UTF-8.
+inline std::size_t utf8_boundary(const char* text, std::size_t size)
+{
+    while (size > 0 && (static_cast<unsigned char>(text[size]) & 0xc0) == 0x80)
+        --size;
+    return size;
+}
+
+inline char* write_bool(char* out, bool value)
+{
+    static const char* const names[] = {"false", "true"};
+    static const std::size_t lengths[] = {5, 4};
+
+    std::memcpy(out, names[value], lengths[value]);
+    return out + lengths[value];
+}
+
+inline void begin_entry(small_string& buffer, const prefix_string& prefix)
+{
+    if (!buffer.empty())
+        buffer += '\n';
+    buffer += prefix.underlying;
+}
+
+#if defined(JG_TEST_STATE_STATS)
+
+// Counts the lines of the text of an output, which is its entries unless values span several lines.
+inline std::uint64_t count_entries(const small_string& text)
+{
+    return text.empty() ? 0 : 1 + static_cast<std::uint64_t>(std::count(text.begin(), text.end(), '\n'));
+}
+
+#endif
+
+// Truncates the entry that was just appended at `entry_begin`, or drops it if the output was already
+// truncated, when the output has grown beyond `settings::max_output_bytes`.
+inline void limit_entry(small_string& buffer, std::size_t entry_begin, std::size_t& omitted_bytes)
+{
+    const auto max_output_bytes = global_settings().max_output_bytes;
+    if (omitted_bytes == 0 && buffer.size() <= max_output_bytes)
+        return;
+
+    if (omitted_bytes > 0) {
+        const auto marker_size = omitted_chars(omitted_bytes);
+        omitted_bytes += buffer.size() - entry_begin;
+        buffer.resize(entry_begin - marker_size);
+    } else {
+        const auto kept = utf8_boundary(buffer.data(), max_output_bytes);
+        omitted_bytes = buffer.size() - kept;
+        buffer.resize(kept);
+    }
+    append_omitted(buffer, omitted_bytes);
+}
+
+inline void append_omitted(small_string& buffer, std::size_t count)
+{
+    char text[max_omitted_chars];
+    buffer.append(text, write_omitted(text, count));
+}
+
+inline void append_string(small_string& buffer, const char* text, std::size_t size)
+{
+    append_string(buffer, text, size, 0);
+}
+
+// Appends a string of which `omitted` more bytes were left out already, like by `binary::value`.
+inline void append_string(small_string& buffer, const char* text, std::size_t size, std::size_t omitted)
+{
+    const auto max_string_length = global_settings().max_string_length;
+    if (size <= max_string_length && omitted == 0) {
+        append_quoted(buffer, text, size);
+        return;
+    }
+
+    const auto kept = size <= max_string_length ? size : utf8_boundary(text, max_string_length);
+    buffer += '"';
+    append_escaped(buffer, text, kept);
+    append_omitted(buffer, size - kept + omitted);
+    buffer += '"';
+}
+
+inline void append_quoted(small_string& buffer, const char* text, std::size_t size)
+{
+    buffer.reserve(buffer.size() + size + 2);
+    buffer += '"';
+    append_escaped(buffer, text, size);
+    buffer += '"';
+}
+
+// Word-at-a-time test for any byte that must be escaped in a JSON string: a control character (less than
+// 0x20), a double quote or a backslash. See "Determine if a word has a byte less than n" in Sean Eron
+// Anderson's "Bit Twiddling Hacks". The high bit of a byte in the result is set if the word has such a byte,
+// which is exact for whether the word has such a byte, but not for where.
+inline std::uint64_t escape_bits(std::uint64_t word)
+{
+    constexpr std::uint64_t ones = 0x0101010101010101ull;
+    constexpr std::uint64_t highs = 0x8080808080808080ull;
+    const std::uint64_t quotes = word ^ (ones * '"');
+    const std::uint64_t backslashes = word ^ (ones * '\\');
+    return (((word - ones * 0x20) & ~word) |
+            ((quotes - ones) & ~quotes) |
+            ((backslashes - ones) & ~backslashes)) & highs;
+}
+
+inline bool needs_escape(char ch)
+{
+    return static_cast<unsigned char>(ch) < 0x20 || ch == '"' || ch == '\\';
+}
+
+// Returns the length of the longest prefix of `text` without characters that must be escaped. With SSE2,
+// which all x86-64 processors have, 16 bytes are tested at a time. Otherwise, blocks of four words are tested
+// with a single branch. Either way, clean text is scanned many bytes per cycle.
+inline std::size_t unescaped_length(const char* text, std::size_t size)
+{
+    std::size_t length = 0;
+#if defined(JG_TEST_STATE_SSE2)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i last_control = _mm_set1_epi8(0x1f);
+    const auto special = [&](std::size_t offset) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + offset));
+        return _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(bytes, backslash)),
+                            _mm_cmpeq_epi8(_mm_min_epu8(bytes, last_control), bytes));
+    };
+    for (; length + 64 <= size; length += 64) {
+        const __m128i any = _mm_or_si128(_mm_or_si128(special(length), special(length + 16)),
+                                         _mm_or_si128(special(length + 32), special(length + 48)));
+        if (_mm_movemask_epi8(any))
+            break;
+    }
+    for (; length + 16 <= size; length += 16) {
+        if (_mm_movemask_epi8(special(length)))
+            break;
+    }
+#else
+    std::uint64_t words[4];
+    for (; length + sizeof(words) <= size; length += sizeof(words)) {
+        std::memcpy(words, text + length, sizeof(words));
+        if (escape_bits(words[0]) | escape_bits(words[1]) | escape_bits(words[2]) | escape_bits(words[3]))
+            break;
+    }
+#endif
+    while (length < size && !needs_escape(text[length]))
+        ++length;
+    return length;
+}
+
+inline void append_escape(small_string& buffer, char ch)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+
+    switch (ch) {
+    case '"': buffer += "\\\""; break;
+    case '\\': buffer += "\\\\"; break;
+    case '\b': buffer += "\\b"; break;
+    case '\f': buffer += "\\f"; break;
+    case '\n': buffer += "\\n"; break;
+    case '\r': buffer += "\\r"; break;
+    case '\t': buffer += "\\t"; break;
+    default: {
+        const auto code = static_cast<unsigned char>(ch);
+        const char escape[] = {'\\', 'u', '0', '0', hex_digits[code >> 4], hex_digits[code & 0xf]};
+        buffer.append(escape, sizeof(escape));
+    }
+    }
+}
+
+// Appends `text` escaped like a JSON string, where runs of characters that don't need escaping, which is
+// typically all of them, are found a word at a time and appended in one go.
+inline void append_escaped(small_string& buffer, const char* text, std::size_t size)
+{
+    if (!global_settings().escape_strings) {
+        buffer.append(text, size);
+        return;
+    }
+
+    for (;;) {
+        const auto length = unescaped_length(text, size);
+        buffer.append(text, length);
+        if (length == size)
+            return;
+        append_escape(buffer, text[length]);
+        text += length + 1;
+        size -= length + 1;
+    }
+}
+
+inline void append_quoted(small_string& buffer, const std::string& text)
+{
+    append_quoted(buffer, text.data(), text.size());
+}
+
+inline void format_property(small_string& buffer, const std::string& name, const small_string& value)
+{
+    // Room for the brackets of `object(property&&)` too, unless that would make a short property allocate.
+    const auto size = name.size() + value.size() + 4;
+    buffer.reserve(size > small_string::inline_capacity ? size + 4 : size);
+    append_quoted(buffer, name);
+    buffer += ": ";
+    buffer += value;
+}
+
+// Inserts `head` at the front of `text` only if `text` has the capacity for it, which doesn't allocate.
+inline bool prepend_in_place(small_string& text, const char* head, std::size_t size)
+{
+    if (text.capacity() - text.size() < size)
+        return false;
+    text.insert(0, head, size);
+    return true;
+}
+
+// Inserts a quoted property name and ": " at the front of `text`, if it fits in place and the name doesn't have
+// to be escaped.
+inline bool prepend_name(small_string& text, const std::string& name)
+{
+    const auto size = name.size() + 4;
+    if (text.capacity() - text.size() < size || unescaped_length(name.data(), name.size()) != name.size())
+        return false;
+    text.insert(0, size, '"');
+    std::memcpy(&text[1], name.data(), name.size());
+    std::memcpy(&text[name.size() + 2], ": ", 2);
+    return true;
+}
+
+inline void add_entry(output& output, const small_string& text)
+{
+    JG_TEST_STATE_COUNT(appended_entries, 1);
+    auto& buffer = output.formatted.underlying;
+    const auto entry_begin = buffer.size();
+    begin_entry(buffer, output.prefix);
+    buffer += text;
+    limit_entry(buffer, entry_begin, output.omitted_bytes);
+}
+
+// The first entry of an output takes over the buffer of `text`, if the prefix fits in front of it.
+inline void add_entry(output& output, small_string&& text)
+{
+    auto& buffer = output.formatted.underlying;
+    if (!buffer.empty() || !prepend_in_place(text, output.prefix.underlying.data(), output.prefix.underlying.size())) {
+        add_entry(output, static_cast<const small_string&>(text));
+        return;
+    }
+    JG_TEST_STATE_COUNT(appended_entries, 1);
+    buffer = std::move(text);
+    limit_entry(buffer, 0, output.omitted_bytes);
+}
+
+inline small_string quote(const std::string& text)
+{
+    small_string quoted;
+    quoted.reserve(text.size() + 2);
+    append_quoted(quoted, text);
+    return quoted;
+}
+
+/// Upper bound of the number of characters written by `write_number` for a value of type `T`.
+template <typename T>
+constexpr std::size_t max_number_chars()
+{
+    return std::is_same<T, bool>::value ? 5
+         : std::is_floating_point<T>::value ? std::numeric_limits<T>::max_digits10 + 18 // "-0.0001" and up to 16 integral digits
+         : std::numeric_limits<T>::digits10 + 1 + std::is_signed<T>::value;
+}
+
+template <typename T>
+char* write_number(char* out, T value, integer_kind)
+{
+    return write_integer(out, value);
+}
+
+template <typename T>
+char* write_number(char* out, T value, floating_point_kind)
+{
+    char text[max_floating_point_chars];
+    const auto size = static_cast<std::size_t>(write_floating_point(text, value) - text);
+    std::memcpy(out, text, size);
+    return out + size;
+}
+
+template <typename T>
+char* write_number(char* out, T value)
+{
+    return write_number(out, value, format_kind<T>{});
+}
+
+inline char* write_number(char* out, bool value)
+{
+    return write_bool(out, value);
+}
+
+template <typename TIterator>
+std::size_t count_remaining(TIterator first, TIterator last, std::random_access_iterator_tag)
+{
+    return static_cast<std::size_t>(last - first);
+}
+
+template <typename TIterator, typename TSentinel, typename TCategory>
+std::size_t count_remaining(TIterator first, TSentinel last, TCategory)
+{
+    std::size_t count = 0;
+    for (; first != last; ++first)
+        ++count;
+    return count;
+}
+
+template <typename TIterator, typename TSentinel>
+std::size_t count_remaining(TIterator first, TSentinel last)
+{
+    using category = typename std::conditional<std::is_same<TIterator, TSentinel>::value,
+        typename std::iterator_traits<TIterator>::iterator_category, std::input_iterator_tag>::type;
+    return count_remaining(first, last, category{});
+}
+
+// Returns the number of chunks to format `count` elements in, where less than 2 means formatting them on the
+// calling thread.
+inline std::size_t parallel_chunks(std::size_t count)
+{
+    const auto& settings = global_settings();
+    if (count < settings.parallel_threshold || count < 2)
+        return 1;
+    const std::size_t threads = settings.parallel_threads ? settings.parallel_threads : std::thread::hardware_concurrency();
+    return threads < count ? threads : count;
+}
+
+// Runs `task(chunk)` for each chunk, the first one on the calling thread and the others on threads of their
+// own that allocate from the memory resource of the calling thread. An exception thrown by a task is rethrown
+// on the calling thread once all tasks are done, like it would be by formatting on one thread.
+template <typename TTask>
+void run_chunks(std::size_t chunks, const TTask& task)
+{
+    auto& resource = current_resource();
+    std::vector<std::exception_ptr> errors(chunks);
+    const auto run = [&task, &errors](std::size_t chunk) {
+        try {
+            task(chunk);
+        } catch (...) {
+            errors[chunk] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(chunks - 1);
+    for (std::size_t chunk = 1; chunk < chunks; ++chunk) {
+        try {
+            workers.emplace_back([&resource, &run, chunk] {
+                scoped_resource scope{resource};
+                run(chunk);
+            });
+        } catch (...) {
+            run(chunk); // The thread couldn't be started, so the calling thread formats the chunk
+        }
+    }
+    run(0);
+    for (auto& worker : workers)
+        worker.join();
+
+    for (const auto& error : errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+
+// Formats `count` elements from `first` in `chunks` chunks of about the same size, each into a buffer of its
+// own, and appends the buffers in order, separated by ", " just like the elements within each chunk.
+template <typename TIterator, typename TFormat>
+void format_chunks(small_string& text, TIterator first, std::size_t count, std::size_t chunks, const TFormat& format_element)
+{
+    using difference = typename std::iterator_traits<TIterator>::difference_type;
+
+    std::vector<small_string> buffers(chunks);
+    run_chunks(chunks, [&](std::size_t chunk) {
+        auto& buffer = buffers[chunk];
+        const auto begin = count * chunk / chunks;
+        const auto end = count * (chunk + 1) / chunks;
+        for (auto i = begin; i < end; ++i) {
+            if (i > begin)
+                buffer += ", ";
+            format_element(buffer, first[static_cast<difference>(i)]);
+        }
+    });
+
+    auto size = text.size() + 2 * chunks;
+    for (const auto& buffer : buffers)
+        size += buffer.size();
+    text.reserve(size);
+    for (std::size_t chunk = 0; chunk < chunks; ++chunk) {
+        if (chunk > 0)
+            text += ", ";
+        text += buffers[chunk];
+    }
+}
+
+// Formats an element like `builder::value()` does.
+template <typename T>
+void format_element(small_string& buffer, const T& value)
+{
+    JG_TEST_STATE_FORMATTING(buffer, false);
+    format_value(buffer, value);
+}
+
+inline void format_element(small_string& buffer, const value& value)
+{
+    buffer += value.formatted.underlying;
+}
+
+template <typename TIterator, typename TSentinel>
+value format_object(TIterator first_property, TSentinel last_property, std::false_type /*is_key_value*/)
+{
+    builder builder;
+    builder.begin_object();
+    const auto max_elements = global_settings().max_elements;
+    for (std::size_t count = 0; first_property != last_property; ++first_property, ++count) {
+        if (count == max_elements) {
+            builder.omitted(count_remaining(first_property, last_property));
+            break;
+        }
+        builder.property(*first_property);
+    }
+    builder.end_object();
+    return builder.release();
+}
+
+// Formats the keys and values of associative containers and other ranges of pairs straight into one buffer,
+// without creating a `property` for each pair.
+template <typename TIterator, typename TSentinel>
+value format_object(TIterator first_pair, TSentinel last_pair, std::true_type /*is_key_value*/)
+{
+    return format_object(first_pair, last_pair, std::true_type{}, is_random_access_range<TIterator, TSentinel>{});
+}
+
+template <typename TIterator, typename TSentinel>
+value format_object(TIterator first_pair, TSentinel last_pair, std::true_type /*is_key_value*/, std::false_type /*is_random_access*/)
+{
+    small_string text;
+    text += '{';
+    const auto max_elements = global_settings().max_elements;
+    std::size_t count = 0;
+    for (; first_pair != last_pair; ++first_pair, ++count) {
+        text += count > 0 ? ", " : " ";
+        if (count == max_elements) {
+            append_omitted(text, count_remaining(first_pair, last_pair));
+            ++count;
+            break;
+        }
+        const auto& pair = *first_pair;
+        format_key(text, pair.first);
+        text += ": ";
+        format_value(text, pair.second);
+    }
+    text += count > 0 ? " }" : "}";
+    return value{formatted_string{std::move(text)}};
+}
+
+template <typename TIterator>
+value format_object(TIterator first_pair, TIterator last_pair, std::true_type /*is_key_value*/, std::true_type /*is_random_access*/)
+{
+    const auto total = static_cast<std::size_t>(last_pair - first_pair);
+    const auto max_elements = global_settings().max_elements;
+    const auto count = total < max_elements ? total : max_elements;
+    const auto chunks = parallel_chunks(count);
+    if (chunks < 2)
+        return format_object(first_pair, last_pair, std::true_type{}, std::false_type{});
+
+    small_string text;
+    text += "{ ";
+    format_chunks(text, first_pair, count, chunks, [](small_string& buffer, const decltype(*first_pair)& pair) {
+        format_key(buffer, pair.first);
+        buffer += ": ";
+        format_value(buffer, pair.second);
+    });
+    if (count < total) {
+        text += ", ";
+        append_omitted(text, total - count);
+    }
+    text += " }";
+    return value{formatted_string{std::move(text)}};
+}
+
+// Keys are quoted property names. Keys that aren't strings are formatted like values first.
+template <typename T>
+void format_key(small_string& buffer, const T& key)
+{
+    small_string text;
+    format_value(text, key);
+    append_quoted(buffer, text.data(), text.size());
+}
+
+inline void format_key(small_string& buffer, const std::string& key)
+{
+    append_quoted(buffer, key);
+}
+
+inline void format_key(small_string& buffer, const char* key)
+{
+    append_quoted(buffer, key, std::strlen(key));
+}
+
+template <typename TIterator, typename TSentinel>
+value format_array(TIterator first_value, TSentinel last_value, std::false_type /*is_contiguous_number*/)
+{
+    return format_array(first_value, last_value, std::false_type{}, is_random_access_range<TIterator, TSentinel>{});
+}
+
+template <typename TIterator, typename TSentinel>
+value format_array(TIterator first_value, TSentinel last_value, std::false_type /*is_contiguous_number*/, std::false_type /*is_random_access*/)
+{
+    builder builder;
+    builder.begin_array();
+    const auto max_elements = global_settings().max_elements;
+    for (std::size_t count = 0; first_value != last_value; ++first_value, ++count) {
+        if (count == max_elements) {
+            builder.omitted(count_remaining(first_value, last_value));
+            break;
+        }
+        builder.value(*first_value);
+    }
+    builder.end_array();
+    return builder.release();
+}
+
+template <typename TIterator>
+value format_array(TIterator first_value, TIterator last_value, std::false_type /*is_contiguous_number*/, std::true_type /*is_random_access*/)
+{
+    const auto total = static_cast<std::size_t>(last_value - first_value);
+    const auto max_elements = global_settings().max_elements;
+    const auto count = total < max_elements ? total : max_elements;
+    const auto chunks = parallel_chunks(count);
+    if (chunks < 2)
+        return format_array(first_value, last_value, std::false_type{}, std::false_type{});
+
+    small_string text;
+    text += "[ ";
+    format_chunks(text, first_value, count, chunks, [](small_string& buffer, const decltype(*first_value)& element) {
+        format_element(buffer, element);
+    });
+    if (count < total) {
+        text += ", ";
+        append_omitted(text, total - count);
+    }
+    text += " ]";
+    return value{formatted_string{std::move(text)}};
+}
+
+// Formats a contiguous range of numbers in a tight loop straight into one buffer, that is sized once from an
+// upper bound of the formatted length.
+template <typename TIterator>
+value format_array(TIterator first_value, TIterator last_value, std::true_type /*is_contiguous_number*/)
+{
+    using number = typename std::iterator_traits<TIterator>::value_type;
+
+    const auto total = static_cast<std::size_t>(last_value - first_value);
+    if (total == 0)
+        return value{formatted_string{"[]"}};
+
+    const auto max_elements = global_settings().max_elements;
+    const auto count = total < max_elements ? total : max_elements;
+    const number* const numbers = &*first_value;
+    small_string text;
+    text.reserve(4 + count * (max_number_chars<number>() + 2) + max_omitted_chars);
+
+    char* const begin = text.data();
+    char* out = begin;
+    *out++ = '[';
+    for (std::size_t i = 0; i < count; ++i) {
+        if (i > 0)
+            *out++ = ',';
+        *out++ = ' ';
+        out = write_number(out, numbers[i]);
+    }
+    if (count < total) {
+        if (count > 0)
+            *out++ = ',';
+        *out++ = ' ';
+        out = write_omitted(out, total - count);
+    }
+    *out++ = ' ';
+    *out++ = ']';
+
+    // Values keep their text, so an upper bound that's more than twice the text is released, at the cost of
+    // one more allocation and copy.
+    text.set_size(static_cast<std::size_t>(out - begin));
+    if (text.capacity() > 2 * text.size())
+        text.shrink_to_fit();
+    return value{formatted_string{std::move(text)}};
+}
+
+template <typename T>
+void format_value(small_string& buffer, const T& value, integer_kind)
+{
+    char text[max_integer_chars];
+    buffer.append(text, write_integer(text, value));
+}
+
+template <typename T>
+void format_value(small_string& buffer, const T& value, floating_point_kind)
+{
+    char text[max_floating_point_chars];
+    buffer.append(text, write_floating_point(text, value));
+}
+
+template <typename T>
+void format_value(small_string& buffer, const T& value, character_kind)
+{
+    buffer += static_cast<char>(value);
+}
+
+template <typename T>
+void format_value(small_string& buffer, const T& value, stream_kind, std::true_type /*reuse_stream*/)
+{
+    stream_lease lease{buffer};
+    output_value(lease.stream(), value);
+}
+
+template <typename T>
+void format_value(small_string& buffer, const T& value, stream_kind, std::false_type /*reuse_stream*/)
+{
+    std::ostringstream stream;
+    output_value(stream, value);
+    buffer += stream.str();
+}
+
+template <typename T>
+void format_value(small_string& buffer, const T& value, stream_kind kind)
+{
+#if defined(JG_TEST_STATE_STATS)
+    ++thread_statistics().stream_formats;
+#endif
+    format_value(buffer, value, kind, std::integral_constant<bool, reuse_stream<T>::value>{});
+}
+
+template <typename T>
+void format_value(small_string& buffer, const T& value)
+{
+    format_value(buffer, value, format_kind<T>{});
+}
+
+inline void format_value(small_string& buffer, const std::string& value)
+{
+    append_string(buffer, value.data(), value.size());
+}
+
+template <typename T>
+void format_value(small_string& buffer, T* value)
+{
+    format_value(buffer, const_cast<const T*>(value));
+}
+
+template <typename T>
+void format_value(small_string& buffer, const T* value)
+{
+    char text[max_pointer_chars];
+    buffer.append(text, write_pointer(text, value));
+}
+
+inline void format_value(small_string& buffer, std::nullptr_t)
+{
+    buffer += "null";
+}
+
+inline void format_value(small_string& buffer, char* value)
+{
+    append_string(buffer, value, std::strlen(value));
+}
+
+inline void format_value(small_string& buffer, const char* value)
+{
+    append_string(buffer, value, std::strlen(value));
+}
+
+inline void format_value(small_string& buffer, bool value)
+{
+    char text[5];
+    buffer.append(text, write_bool(text, value));
+}
+
+inline void format_value(small_string& buffer, const value& value)
+{
+    buffer += value.formatted.underlying;
+}
+
+inline void format_value(small_string& buffer, const property& property)
+{
+    buffer += property.formatted.underlying;
+}
+
+template <typename T>
+void format_value(small_string& buffer, const deferred_property<T>& property)
+{
+    append_quoted(buffer, property.name);
+    buffer += ": ";
+    format_value(buffer, property.value);
+}
+
+template <typename T1, typename T2>
+void format_value(small_string& buffer, const std::pair<T1, T2>& pair)
+{
+    buffer += "[ ";
+    format_value(buffer, pair.first);
+    buffer += ", ";
+    format_value(buffer, pair.second);
+    buffer += " ]";
+}
+
+template <typename TTuple, std::size_t... Indices>
+void format_elements(small_string& buffer, const TTuple& tuple, std::index_sequence<Indices...>)
+{
+    const int expand[] = {0, (buffer += Indices == 0 ? "[ " : ", ", format_value(buffer, std::get<Indices>(tuple)), 0)...};
+    static_cast<void>(expand);
+    buffer += " ]";
+}
+
+inline void format_elements(small_string& buffer, const std::tuple<>&, std::index_sequence<>)
+{
+    buffer += "[]";
+}
+
+template <typename... T>
+void format_value(small_string& buffer, const std::tuple<T...>& tuple)
+{
+    format_elements(buffer, tuple, std::index_sequence_for<T...>{});
+}
+
+#if defined(JG_TEST_STATE_OPTIONAL_VARIANT)
+template <typename T>
+void format_value(small_string& buffer, const std::optional<T>& optional)
+{
+    if (optional)
+        format_value(buffer, *optional);
+    else
+        buffer += "null";
+}
+
+inline void format_value(small_string& buffer, std::nullopt_t)
+{
+    buffer += "null";
+}
+
+template <typename... T>
+void format_value(small_string& buffer, const std::variant<T...>& variant)
+{
+    if (variant.valueless_by_exception())
+        buffer += "null";
+    else
+        std::visit([&buffer](const auto& alternative) { format_value(buffer, alternative); }, variant);
+}
+
+inline void format_value(small_string& buffer, std::monostate)
+{
+    buffer += "null";
+}
+#endif
+
+template <typename T>
+void output_value(std::ostream& stream, const T& value)
+{
+    stream << value;
+}
+
+inline void output_value(std::ostream& stream, const std::string& value)
+{
+    stream << quote(value);
+}
+
+template <typename T>
+inline void output_value(std::ostream& stream, T* value)
+{
+    output_value(stream, const_cast<const T*>(value));
+}
+
+template <typename T>
+inline void output_value(std::ostream& stream, const T* value)
+{
+    char text[max_pointer_chars];
+    stream.write(text, write_pointer(text, value) - text);
+}
+
+inline void output_value(std::ostream& stream, std::nullptr_t)
+{
+    stream << "null";
+}
+
+inline void output_value(std::ostream& stream, char* value)
+{
+    stream << quote(value);
+}
+
+inline void output_value(std::ostream& stream, const char* value)
+{
+    stream << quote(value);
+}
+
+inline void output_value(std::ostream& stream, bool value)
+{
+    char text[5];
+    stream.write(text, write_bool(text, value) - text);
+}
+
+inline void push_entry(ring_output& output, const char* text, std::size_t size)
+{
+    const auto capacity = output.bytes.size();
+    if (capacity == 0 || output.entries.empty())
+        return;
+    if (size > capacity)
+        size = utf8_boundary(text, capacity);
+
+    while (output.entry_count == output.entries.size() || capacity - output.byte_count < size) {
+        const auto& oldest = output.entries[output.oldest_entry];
+        output.oldest_byte = (oldest.offset + oldest.size) % capacity;
+        output.byte_count -= oldest.size;
+        output.oldest_entry = (output.oldest_entry + 1) % output.entries.size();
+        --output.entry_count;
+        ++output.overwritten;
+    }
+    if (output.entry_count == 0)
+        output.oldest_byte = 0;
+
+    const auto offset = (output.oldest_byte + output.byte_count) % capacity;
+    const auto first_part = size < capacity - offset ? size : capacity - offset;
+    std::memcpy(output.bytes.data() + offset, text, first_part);
+    std::memcpy(output.bytes.data(), text + first_part, size - first_part);
+
+    output.entries[(output.oldest_entry + output.entry_count) % output.entries.size()] = {offset, size};
+    ++output.entry_count;
+    output.byte_count += size;
+}
+
+
+} // namespace detail
+
+inline ring_output::ring_output(std::size_t capacity_bytes, std::size_t capacity_entries, prefix_string prefix)
+    : prefix{std::move(prefix)}
+    , bytes(capacity_bytes)
+    , entries(capacity_entries)
+{}
+
+template <typename T>
+ring_output& ring_output::add(const T& value)
+{
+    scratch.clear();
+    JG_TEST_STATE_FORMATTING(scratch, true);
+    detail::format_value(scratch, value);
+    detail::push_entry(*this, scratch.data(), scratch.size());
+    return *this;
+}
+
+template <typename T>
+ring_output& ring_output::add(const std::string& name, const T& value)
+{
+    scratch.clear();
+    JG_TEST_STATE_FORMATTING(scratch, true);
+    detail::append_quoted(scratch, name);
+    scratch += ": ";
+    detail::format_value(scratch, value);
+    detail::push_entry(*this, scratch.data(), scratch.size());
+    return *this;
+}
+
+inline std::ostream& operator<<(std::ostream& stream, const ring_output& output)
+{
+    const auto capacity = output.bytes.size();
+    JG_TEST_STATE_COUNT(streamed_entries, output.entry_count);
+    for (std::size_t i = 0; i < output.entry_count; ++i) {
+        const auto& entry = output.entries[(output.oldest_entry + i) % output.entries.size()];
+        const auto first_part = entry.size < capacity - entry.offset ? entry.size : capacity - entry.offset;
+        if (i > 0)
+            stream << '\n';
+        stream << output.prefix.underlying;
+        stream.write(output.bytes.data() + entry.offset, static_cast<std::streamsize>(first_part));
+        stream.write(output.bytes.data(), static_cast<std::streamsize>(entry.size - first_part));
+    }
+    return stream;
+}
+
+inline ring_output& operator+=(ring_output& output, const value& value)
+{
+    return output.add(value);
+}
+
+inline ring_output& operator+=(ring_output& output, const property& property)
+{
+    return output.add(property);
+}
+
+inline sampled_output::sampled_output(sampling policy, prefix_string prefix)
+    : policy{std::move(policy)}
+    , kept{std::move(prefix)}
+{}
+
+inline bool sampled_output::sample()
+{
+    const auto index = seen++;
+    bool keep = (policy.every_nth <= 1 || index % policy.every_nth == 0) && (!policy.condition || policy.condition());
+    if (keep && policy.max_per_window != std::numeric_limits<std::size_t>::max()) {
+        const auto now = std::chrono::steady_clock::now();
+        if (window_count == 0 || now - window_start >= policy.window) {
+            window_start = now;
+            window_count = 0;
+        }
+        keep = window_count < policy.max_per_window;
+        if (keep)
+            ++window_count;
+    }
+    if (!keep)
+        ++skipped;
+    return keep;
+}
+
+template <typename T>
+sampled_output& sampled_output::add(const T& value)
+{
+    if (!sample())
+        return *this;
+    auto& buffer = kept.formatted.underlying;
+    JG_TEST_STATE_FORMATTING(buffer, true);
+    const auto entry_begin = buffer.size();
+    detail::begin_entry(buffer, kept.prefix);
+    detail::format_value(buffer, value);
+    detail::limit_entry(buffer, entry_begin, kept.omitted_bytes);
+    return *this;
+}
+
+template <typename T>
+sampled_output& sampled_output::add(const std::string& name, const T& value)
+{
+    if (!sample())
+        return *this;
+    auto& buffer = kept.formatted.underlying;
+    JG_TEST_STATE_FORMATTING(buffer, true);
+    const auto entry_begin = buffer.size();
+    detail::begin_entry(buffer, kept.prefix);
+    detail::append_quoted(buffer, name);
+    buffer += ": ";
+    detail::format_value(buffer, value);
+    detail::limit_entry(buffer, entry_begin, kept.omitted_bytes);
+    return *this;
+}
+
+inline std::ostream& operator<<(std::ostream& stream, const sampled_output& output)
+{
+    stream << output.kept;
+    if (output.skipped > 0) {
+        if (!output.kept.formatted.underlying.empty())
+            stream << '\n';
+        stream << output.kept.prefix.underlying << "... (+" << output.skipped << " skipped)";
+    }
+    return stream;
+}
+
+template <typename T>
+sampled_output& operator+=(sampled_output& output, const T& value)
+{
+    return output.add(value);
+}
+
+inline sampled_output& operator+=(sampled_output& output, const property& property)
+{
+    return output.add(property);
+}
+
+namespace detail {
+
+// Returns the end of the string value or name that starts with the quote at `begin`, after its closing quote.
+inline std::size_t skip_quoted(const small_string& text, std::size_t begin, std::size_t end)
+{
+    for (auto i = begin + 1; i < end; ++i) {
+        if (text[i] == '\\')
+            ++i;
+        else if (text[i] == '"')
+            return i + 1;
+    }
+    return end + 1;
+}
+
+// Returns whether a property name, like `"name": `, starts at `position`.
+inline bool starts_name(const small_string& text, std::size_t position, std::size_t end)
+{
+    if (position >= end || text[position] != '"')
+        return false;
+    position = skip_quoted(text, position, end);
+    return position + 2 <= end && text[position] == ':' && text[position + 1] == ' ';
+}
+
+// Splits the properties of object text, as formatted by `object(...)`, into `fields`. Values are scanned to
+// the next ", " before a property name, outside of strings and brackets. Returns false for text that isn't
+// such an object, and for objects with a truncation marker instead of a property.
+inline bool parse_object(const small_string& text, std::vector<snapshot_field>& fields)
+{
+    fields.clear();
+    const auto size = text.size();
+    if (size == 2 && text[0] == '{' && text[1] == '}')
+        return true;
+    if (size < 4 || text[0] != '{' || text[1] != ' ' || text[size - 2] != ' ' || text[size - 1] != '}')
+        return false;
+
+    const auto end = size - 2;
+    std::size_t position = 2;
+    for (;;) {
+        if (!starts_name(text, position, end))
+            return false;
+        const auto name_begin = position;
+        position = skip_quoted(text, position, end);
+        const auto name_size = position - name_begin;
+        const auto value_begin = position += 2;
+
+        int depth = 0;
+        for (; position < end; ++position) {
+            const auto c = text[position];
+            if (c == '"')
+                position = skip_quoted(text, position, end) - 1;
+            else if (c == '{' || c == '[' || c == '(')
+                ++depth;
+            else if (c == '}' || c == ']' || c == ')')
+                --depth;
+            else if (c == ',' && depth == 0 && position + 1 < end && text[position + 1] == ' ') {
+                if (starts_name(text, position + 2, end))
+                    break;
+                if (end - position >= 8 && std::memcmp(text.data() + position + 2, "... (+", 6) == 0)
+                    return false; // Truncated by `settings::max_elements`
+            }
+        }
+        if (depth != 0 || position > end)
+            return false;
+        fields.push_back({name_begin, name_size, value_begin, position - value_begin, false});
+        if (position == end)
+            return true;
+        position += 2;
+    }
+}
+
+inline bool equal_text(const small_string& text1, std::size_t begin1, std::size_t size1,
+                       const small_string& text2, std::size_t begin2, std::size_t size2)
+{
+    return size1 == size2 && std::memcmp(text1.data() + begin1, text2.data() + begin2, size1) == 0;
+}
+
+// Finds the unmatched field of `fields` with the name of `field`, starting at `hint` since snapshots usually
+// have their properties in the same order.
+inline snapshot_field* find_field(std::vector<snapshot_field>& fields, const small_string& fields_text, std::size_t hint,
+                                  const snapshot_field& field, const small_string& field_text)
+{
+    for (std::size_t n = 0; n < fields.size(); ++n) {
+        auto& candidate = fields[(hint + n) % fields.size()];
+        if (!candidate.matched && equal_text(fields_text, candidate.name_begin, candidate.name_size,
+                                             field_text, field.name_begin, field.name_size))
+            return &candidate;
+    }
+    return nullptr;
+}
+
+inline void append_field(small_string& buffer, bool first, const small_string& text, const snapshot_field& field)
+{
+    buffer += first ? " " : ", ";
+    buffer.append(text.data() + field.name_begin, field.name_size);
+    buffer += ": ";
+}
+
+} // namespace detail
+
+inline delta_output::delta_output(prefix_string prefix)
+    : changes{std::move(prefix)}
+{}
+
+inline delta_output& delta_output::add(const value& snapshot)
+{
+    const auto& text = snapshot.formatted.underlying;
+    const bool is_object = detail::parse_object(text, current_fields);
+    if (!is_object)
+        ++whole_snapshots;
+    auto& buffer = changes.formatted.underlying;
+    const auto entry_begin = buffer.size();
+
+    if (!is_object || !previous_is_object || snapshots == 0) {
+        if (snapshots > 0 && !is_object && !previous_is_object && text == previous) {
+            ++unchanged;
+        } else {
+            JG_TEST_STATE_COUNT(appended_entries, 1);
+            detail::begin_entry(buffer, changes.prefix);
+            buffer += text;
+            detail::limit_entry(buffer, entry_begin, changes.omitted_bytes);
+        }
+    } else {
+        detail::begin_entry(buffer, changes.prefix);
+        const auto delta_begin = buffer.size();
+        buffer += '{';
+        for (std::size_t i = 0; i < current_fields.size(); ++i) {
+            const auto& field = current_fields[i];
+            auto* previous_field = detail::find_field(fields, previous, i, field, text);
+            if (previous_field) {
+                previous_field->matched = true;
+                if (detail::equal_text(previous, previous_field->value_begin, previous_field->value_size,
+                                       text, field.value_begin, field.value_size))
+                    continue;
+            }
+            detail::append_field(buffer, buffer.size() == delta_begin + 1, text, field);
+            buffer.append(text.data() + field.value_begin, field.value_size);
+        }
+        for (const auto& field : fields) {
+            if (field.matched)
+                continue;
+            detail::append_field(buffer, buffer.size() == delta_begin + 1, previous, field);
+            buffer += "(removed)";
+        }
+        if (buffer.size() == delta_begin + 1) {
+            buffer.resize(entry_begin);
+            ++unchanged;
+        } else {
+            JG_TEST_STATE_COUNT(appended_entries, 1);
+            buffer += " }";
+            detail::limit_entry(buffer, entry_begin, changes.omitted_bytes);
+        }
+    }
+
+    ++snapshots;
+    previous = text;
+    previous_is_object = is_object;
+    fields.swap(current_fields);
+    return *this;
+}
+
+inline std::ostream& operator<<(std::ostream& stream, const delta_output& output)
+{
+    return stream << output.changes;
+}
+
+inline delta_output& operator+=(delta_output& output, const value& snapshot)
+{
+    return output.add(snapshot);
+}
+
+namespace detail {
+
+// FNV-1a
+inline std::uint64_t hash_text(const char* text, std::size_t size)
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    for (std::size_t i = 0; i < size; ++i)
+        hash = (hash ^ static_cast<unsigned char>(text[i])) * 1099511628211ull;
+    return hash;
+}
+
+inline std::uint32_t text_set::insert(const char* text, std::size_t size)
+{
+    if ((ends.size() + 1) * 2 > slots.size())
+        grow();
+    const auto hash = hash_text(text, size);
+    auto& slot = slots[probe(hash, text, size)];
+    if (slot.id == npos) {
+        slot = {hash, static_cast<std::uint32_t>(ends.size())};
+        texts.append(text, size);
+        ends.push_back(texts.size());
+    }
+    return slot.id;
+}
+
+inline std::uint32_t text_set::find(const char* text, std::size_t size) const
+{
+    return slots.empty() ? npos : slots[probe(hash_text(text, size), text, size)].id;
+}
+
+inline const char* text_set::data(std::uint32_t id) const
+{
+    return texts.data() + (id > 0 ? ends[id - 1] : 0);
+}
+
+inline std::size_t text_set::size(std::uint32_t id) const
+{
+    return ends[id] - (id > 0 ? ends[id - 1] : 0);
+}
+
+inline std::size_t text_set::count() const
+{
+    return ends.size();
+}
+
+// Returns the index of the slot of `text`, or of the empty slot where it belongs.
+inline std::size_t text_set::probe(std::uint64_t hash, const char* text, std::size_t size) const
+{
+    const auto mask = slots.size() - 1;
+    for (auto index = static_cast<std::size_t>(hash) & mask;; index = (index + 1) & mask) {
+        const auto& slot = slots[index];
+        if (slot.id == npos || (slot.hash == hash && this->size(slot.id) == size && std::memcmp(data(slot.id), text, size) == 0))
+            return index;
+    }
+}
+
+inline void text_set::grow()
+{
+    std::vector<slot> grown(slots.empty() ? 16 : slots.size() * 2, slot{0, npos});
+    const auto mask = grown.size() - 1;
+    for (const auto& slot : slots) {
+        if (slot.id == npos)
+            continue;
+        auto index = static_cast<std::size_t>(slot.hash) & mask;
+        while (grown[index].id != npos)
+            index = (index + 1) & mask;
+        grown[index] = slot;
+    }
+    slots.swap(grown);
+}
+
+} // namespace detail
+
+inline intern_table::intern_table(std::size_t max_texts)
+    : max_texts{max_texts}
+{}
+
+inline std::uint32_t intern_table::intern(const char* text, std::size_t size)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+    return insert(text, size);
+}
+
+inline std::uint32_t intern_table::intern_name(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+    const auto id = names.find(name.data(), name.size());
+    if (id != npos)
+        return quoted[id];
+    const auto quoted_name = detail::quote(name);
+    const auto quoted_id = insert(quoted_name.data(), quoted_name.size());
+    if (quoted_id != npos) {
+        names.insert(name.data(), name.size());
+        quoted.push_back(quoted_id);
+    }
+    return quoted_id;
+}
+
+// Called with the mutex locked.
+inline std::uint32_t intern_table::insert(const char* text, std::size_t size)
+{
+    if (texts.count() < max_texts)
+        return texts.insert(text, size);
+    return texts.find(text, size);
+}
+
+inline std::size_t intern_table::size() const
+{
+    std::lock_guard<std::mutex> lock{mutex};
+    return texts.count();
+}
+
+inline intern_table& global_intern_table()
+{
+    static intern_table table;
+    return table;
+}
+
+inline interned_output::interned_output(prefix_string prefix)
+    : own_table{std::make_unique<intern_table>()}
+    , table{own_table.get()}
+    , prefix{std::move(prefix)}
+{}
+
+inline interned_output::interned_output(intern_table& table, prefix_string prefix)
+    : table{&table}
+    , prefix{std::move(prefix)}
+{}
+
+namespace detail {
+
+// Returns the id of `text` in the table of `output`, or its index in `literals` with `literal_bit` set if
+// it's not in the table.
+inline std::uint32_t intern_text(interned_output& output, const char* text, std::size_t size, bool is_name)
+{
+    if (is_name || size <= intern_table::max_value_size) {
+        const auto id = output.table->intern(text, size);
+        if (id != intern_table::npos)
+            return id;
+    }
+    return output.literals.insert(text, size) | interned_output::literal_bit;
+}
+
+inline std::uint32_t intern_name(interned_output& output, const std::string& name)
+{
+    const auto id = output.table->intern_name(name);
+    if (id != intern_table::npos)
+        return id;
+    const auto quoted_name = quote(name);
+    return output.literals.insert(quoted_name.data(), quoted_name.size()) | interned_output::literal_bit;
+}
+
+inline std::uint32_t intern_value(interned_output& output)
+{
+    return intern_text(output, output.scratch.data(), output.scratch.size(), false);
+}
+
+} // namespace detail
+
+template <typename T>
+interned_output& interned_output::add(const T& value)
+{
+    scratch.clear();
+    JG_TEST_STATE_FORMATTING(scratch, true);
+    detail::format_value(scratch, value);
+    entries.push_back({no_name, detail::intern_value(*this)});
+    return *this;
+}
+
+template <typename T>
+interned_output& interned_output::add(const std::string& name, const T& value)
+{
+    const auto name_id = detail::intern_name(*this, name);
+    scratch.clear();
+    JG_TEST_STATE_FORMATTING(scratch, true);
+    detail::format_value(scratch, value);
+    entries.push_back({name_id, detail::intern_value(*this)});
+    return *this;
+}
+
+inline std::ostream& operator<<(std::ostream& stream, const interned_output& output)
+{
+    JG_TEST_STATE_COUNT(streamed_entries, output.entries.size());
+    const auto& table = *output.table;
+    detail::small_string text;
+    const auto append = [&](std::uint32_t id) {
+        if (id & interned_output::literal_bit) {
+            const auto index = id & ~interned_output::literal_bit;
+            text.append(output.literals.data(index), output.literals.size(index));
+        } else {
+            text.append(table.texts.data(id), table.texts.size(id));
+        }
+    };
+    {
+        // Locked once for all entries, instead of once per text.
+        std::lock_guard<std::mutex> lock{table.mutex};
+        for (const auto& entry : output.entries) {
+            detail::begin_entry(text, output.prefix);
+            if (entry.name != interned_output::no_name) {
+                append(entry.name);
+                text += ": ";
+            }
+            append(entry.value);
+        }
+    }
+    return stream << text;
+}
+
+inline interned_output& operator+=(interned_output& output, const value& value)
+{
+    return output.add(value);
+}
+
+inline interned_output& operator+=(interned_output& output, const property& property)
+{
+    // The formatted property is the quoted name, ": " and the value.
+    const auto& text = property.formatted.underlying;
+    const auto name_end = detail::skip_quoted(text, 0, text.size());
+    const auto value_begin = name_end + 2;
+    const auto name_id = detail::intern_text(output, text.data(), name_end, true);
+    output.entries.push_back(
+        {name_id, detail::intern_text(output, text.data() + value_begin, text.size() - value_begin, false)});
+    return output;
+}
+
+namespace detail {
+
+inline void format_value(small_string& buffer, const text_span& text)
+{
+    buffer.append(text.data, text.size);
+}
+
+inline void format_value(small_string& buffer, const string_span& text)
+{
+    append_string(buffer, text.data, text.size);
+}
+
+inline void encode_tag(std::string& buffer, binary::tag tag)
+{
+    buffer += static_cast<char>(tag);
+}
+
+inline void encode_length(std::string& buffer, std::uint64_t length)
+{
+    char bytes[10];
+    std::size_t size = 0;
+    do {
+        auto byte = static_cast<unsigned char>(length & 0x7f);
+        length >>= 7;
+        if (length != 0)
+            byte = static_cast<unsigned char>(byte | 0x80);
+        bytes[size++] = static_cast<char>(byte);
+    } while (length != 0);
+    buffer.append(bytes, size);
+}
+
+template <typename T>
+void encode_raw(std::string& buffer, binary::tag tag, const T& value)
+{
+    char bytes[1 + sizeof(T)];
+    bytes[0] = static_cast<char>(tag);
+    std::memcpy(bytes + 1, &value, sizeof(T));
+    buffer.append(bytes, sizeof(bytes));
+}
+
+inline void encode_bytes(std::string& buffer, binary::tag tag, const char* data, std::size_t size)
+{
+    encode_tag(buffer, tag);
+    encode_length(buffer, size);
+    buffer.append(data, size);
+}
+
+template <typename T>
+constexpr binary::tag number_tag(integer_kind)
+{
+    return sizeof(T) == 2 ? (std::is_signed<T>::value ? binary::tag::int16 : binary::tag::uint16)
+         : sizeof(T) == 4 ? (std::is_signed<T>::value ? binary::tag::int32 : binary::tag::uint32)
+         : (std::is_signed<T>::value ? binary::tag::int64 : binary::tag::uint64);
+}
+
+template <typename T>
+constexpr binary::tag number_tag(floating_point_kind)
+{
+    return std::is_same<T, float>::value ? binary::tag::float32
+         : std::is_same<T, double>::value ? binary::tag::float64
+         : binary::tag::long_double;
+}
+
+template <typename T>
+constexpr binary::tag number_tag()
+{
+    static_assert(sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8 || std::is_floating_point<T>::value, "Unsupported number size");
+    return number_tag<T>(format_kind<T>{});
+}
+
+template <typename T>
+void encode_value(std::string& buffer, const T& value, integer_kind)
+{
+    encode_raw(buffer, number_tag<T>(), value);
+}
+
+template <typename T>
+void encode_value(std::string& buffer, const T& value, floating_point_kind)
+{
+    encode_raw(buffer, number_tag<T>(), value);
+}
+
+template <typename T>
+void encode_value(std::string& buffer, const T& value, character_kind)
+{
+    encode_raw(buffer, binary::tag::character, static_cast<char>(value));
+}
+
+template <typename T>
+void encode_value(std::string& buffer, const T& value, stream_kind)
+{
+    small_string text;
+    format_value(text, value);
+    encode_bytes(buffer, binary::tag::text, text.data(), text.size());
+}
+
+template <typename T>
+void encode_value(std::string& buffer, const T& value)
+{
+    encode_value(buffer, value, format_kind<T>{});
+}
+
+// Strings are truncated to `settings::max_string_length` when they're encoded, so that a huge string isn't
+// copied in full, and the omitted byte count is encoded for the marker.
+inline void encode_string(std::string& buffer, const char* text, std::size_t size)
+{
+    const auto max_string_length = global_settings().max_string_length;
+    if (size <= max_string_length) {
+        encode_bytes(buffer, binary::tag::string, text, size);
+        return;
+    }
+
+    const auto kept = utf8_boundary(text, max_string_length);
+    encode_bytes(buffer, binary::tag::truncated_string, text, kept);
+    encode_length(buffer, size - kept);
+}
+
+inline void encode_value(std::string& buffer, const std::string& value)
+{
+    encode_string(buffer, value.data(), value.size());
+}
+
+template <typename T>
+void encode_value(std::string& buffer, T* value)
+{
+    encode_value(buffer, const_cast<const T*>(value));
+}
+
+template <typename T>
+void encode_value(std::string& buffer, const T* value)
+{
+    const void* const address = value;
+    encode_raw(buffer, binary::tag::pointer, address);
+}
+
+inline void encode_value(std::string& buffer, std::nullptr_t)
+{
+    encode_tag(buffer, binary::tag::null);
+}
+
+inline void encode_value(std::string& buffer, char* value)
+{
+    encode_string(buffer, value, std::strlen(value));
+}
+
+inline void encode_value(std::string& buffer, const char* value)
+{
+    encode_string(buffer, value, std::strlen(value));
+}
+
+inline void encode_value(std::string& buffer, bool value)
+{
+    encode_tag(buffer, value ? binary::tag::true_value : binary::tag::false_value);
+}
+
+inline void encode_value(std::string& buffer, const value& value)
+{
+    encode_bytes(buffer, binary::tag::text, value.formatted.underlying.data(), value.formatted.underlying.size());
+}
+
+inline void encode_value(std::string& buffer, const binary::value& value)
+{
+    buffer += value.encoded.underlying;
+}
+
+inline void encode_name(std::string& buffer, const std::string& name)
+{
+    encode_bytes(buffer, binary::tag::name, name.data(), name.size());
+}
+
+inline void encode_property(std::string& buffer, const binary::property& property)
+{
+    buffer += property.encoded.underlying;
+}
+
+template <typename TKey, typename TValue>
+void encode_property(std::string& buffer, const std::pair<TKey, TValue>& pair)
+{
+    encode_key(buffer, pair.first);
+    encode_value(buffer, pair.second);
+}
+
+// Keys are encoded as property names. Keys that aren't strings are formatted like values first.
+template <typename T>
+void encode_key(std::string& buffer, const T& key)
+{
+    small_string text;
+    format_value(text, key);
+    encode_bytes(buffer, binary::tag::name, text.data(), text.size());
+}
+
+inline void encode_key(std::string& buffer, const std::string& key)
+{
+    encode_name(buffer, key);
+}
+
+inline void encode_key(std::string& buffer, const char* key)
+{
+    encode_bytes(buffer, binary::tag::name, key, std::strlen(key));
+}
+
+template <typename T1, typename T2>
+void encode_value(std::string& buffer, const std::pair<T1, T2>& pair)
+{
+    encode_tag(buffer, binary::tag::begin_array);
+    encode_value(buffer, pair.first);
+    encode_value(buffer, pair.second);
+    encode_tag(buffer, binary::tag::end_array);
+}
+
+template <typename TTuple, std::size_t... Indices>
+void encode_elements(std::string& buffer, const TTuple& tuple, std::index_sequence<Indices...>)
+{
+    const int expand[] = {0, (encode_value(buffer, std::get<Indices>(tuple)), 0)...};
+    static_cast<void>(expand);
+}
+
+template <typename... T>
+void encode_value(std::string& buffer, const std::tuple<T...>& tuple)
+{
+    encode_tag(buffer, binary::tag::begin_array);
+    encode_elements(buffer, tuple, std::index_sequence_for<T...>{});
+    encode_tag(buffer, binary::tag::end_array);
+}
+
+#if defined(JG_TEST_STATE_OPTIONAL_VARIANT)
+template <typename T>
+void encode_value(std::string& buffer, const std::optional<T>& optional)
+{
+    if (optional)
+        encode_value(buffer, *optional);
+    else
+        encode_tag(buffer, binary::tag::null);
+}
+
+inline void encode_value(std::string& buffer, std::nullopt_t)
+{
+    encode_tag(buffer, binary::tag::null);
+}
+
+template <typename... T>
+void encode_value(std::string& buffer, const std::variant<T...>& variant)
+{
+    if (variant.valueless_by_exception())
+        encode_tag(buffer, binary::tag::null);
+    else
+        std::visit([&buffer](const auto& alternative) { encode_value(buffer, alternative); }, variant);
+}
+
+inline void encode_value(std::string& buffer, std::monostate)
+{
+    encode_tag(buffer, binary::tag::null);
+}
+#endif
+
+template <typename TIterator, typename TSentinel>
+binary::value encode_array(TIterator first_value, TSentinel last_value, std::false_type /*is_contiguous_number*/)
+{
+    std::string encoded;
+    encode_tag(encoded, binary::tag::begin_array);
+    const auto max_elements = global_settings().max_elements;
+    for (std::size_t count = 0; first_value != last_value; ++first_value, ++count) {
+        if (count == max_elements) {
+            encode_tag(encoded, binary::tag::omitted);
+            encode_length(encoded, count_remaining(first_value, last_value));
+            break;
+        }
+        encode_value(encoded, *first_value);
+    }
+    encode_tag(encoded, binary::tag::end_array);
+    return binary::value{binary::encoded_string{std::move(encoded)}};
+}
+
+// Encodes a contiguous range of numbers as one run of their bytes.
 template <typename TIterator>
-value object(TIterator first_property, TIterator last_property);
-template <typename TRange>
-value object(const TRange& properties);
+binary::value encode_array(TIterator first_value, TIterator last_value, std::true_type /*is_contiguous_number*/)
+{
+    using number = typename std::iterator_traits<TIterator>::value_type;
 
-struct property final
+    const auto total = static_cast<std::size_t>(last_value - first_value);
+    const auto max_elements = global_settings().max_elements;
+    const auto count = total < max_elements ? total : max_elements;
+    std::string encoded;
+    encoded.reserve(16 + count * sizeof(number) + 12);
+    encode_tag(encoded, binary::tag::begin_array);
+    if (count > 0) {
+        encode_tag(encoded, binary::tag::number_run);
+        encode_tag(encoded, number_tag<number>());
+        encode_length(encoded, count);
+        encoded.append(reinterpret_cast<const char*>(&*first_value), count * sizeof(number));
+    }
+    if (count < total) {
+        encode_tag(encoded, binary::tag::omitted);
+        encode_length(encoded, total - count);
+    }
+    encode_tag(encoded, binary::tag::end_array);
+    return binary::value{binary::encoded_string{std::move(encoded)}};
+}
+
+/// Bounds checked reading of an encoding. Reading past the end fails and leaves `failed` set.
+class binary_reader final
 {
-    property(const std::string& name, const value& value);
+public:
+    binary_reader(const char* data, std::size_t size)
+        : next{data}
+        , end{data + size}
+    {}
 
-    formatted_string formatted;
-};
+    bool at_end() const
+    {
+        return next == end;
+    }
 
-std::ostream& operator<<(std::ostream& stream, const property& property);
+    bool read_tag(binary::tag& tag)
+    {
+        if (next == end)
+            return false;
+        tag = static_cast<binary::tag>(*next++);
+        return true;
+    }
 
-// Implementation below this line
+    bool read_length(std::size_t& length)
+    {
+        std::uint64_t result = 0;
+        for (unsigned shift = 0; shift < 64 && next != end; shift += 7) {
+            const auto byte = static_cast<unsigned char>(*next++);
+            result |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                if (result > std::numeric_limits<std::size_t>::max())
+                    return false;
+                length = static_cast<std::size_t>(result);
+                return true;
+            }
+        }
+        return false;
+    }
 
-namespace detail {
+    template <typename T>
+    bool read_raw(T& value)
+    {
+        if (static_cast<std::size_t>(end - next) < sizeof(T))
+            return false;
+        std::memcpy(&value, next, sizeof(T));
+        next += sizeof(T);
+        return true;
+    }
 
-std::string curly_bracket(const std::string& text);
-std::string square_bracket(const std::string& text);
-std::string quote(const std::string& text);
+    bool read_bytes(const char*& data, std::size_t& size)
+    {
+        if (!read_length(size) || static_cast<std::size_t>(end - next) < size)
+            return false;
+        data = next;
+        next += size;
+        return true;
+    }
+
+    bool read_run(const char*& data, std::size_t count, std::size_t element_size)
+    {
+        if (static_cast<std::size_t>(end - next) / element_size < count)
+            return false;
+        data = next;
+        next += count * element_size;
+        return true;
+    }
+
+private:
+    const char* next;
+    const char* end;
+};
 
 template <typename T>
-void output_value(std::ostream& stream, const T& value);
-void output_value(std::ostream& stream, const std::string& value);
-template <typename T>
-void output_value(std::ostream& stream, T* value);
+bool render_raw(builder& builder, binary_reader& reader)
+{
+    T value;
+    if (!reader.read_raw(value))
+        return false;
+    builder.value(value);
+    return true;
+}
+
+// The numbers of a run are formatted in a tight loop, like `format_array(...)` does, and added as one element
+// with the separators between them.
 template <typename T>
-void output_value(std::ostream& stream, const T* value);
-void output_value(std::ostream& stream, std::nullptr_t);
-void output_value(std::ostream& stream, char* value);
-void output_value(std::ostream& stream, const char* value);
-void output_value(std::ostream& stream, bool value);
+bool render_run(builder& builder, binary_reader& reader)
+{
+    std::size_t count = 0;
+    const char* data = nullptr;
+    if (!reader.read_length(count) || !reader.read_run(data, count, sizeof(T)))
+        return false;
+    if (count == 0)
+        return true;
+
+    small_string text;
+    text.reserve(count * (max_number_chars<T>() + 2));
+    char* const begin = text.data();
+    char* out = begin;
+    for (std::size_t i = 0; i < count; ++i) {
+        if (i > 0) {
+            *out++ = ',';
+            *out++ = ' ';
+        }
+        T value;
+        std::memcpy(&value, data + i * sizeof(T), sizeof(T));
+        out = write_number(out, value);
+    }
+    text.set_size(static_cast<std::size_t>(out - begin));
+    builder.value(text_span{text.data(), text.size()});
+    return true;
+}
+
+inline bool render_number(builder& builder, binary_reader& reader, binary::tag tag, bool run)
+{
+    switch (tag) {
+    case binary::tag::int16: return run ? render_run<std::int16_t>(builder, reader) : render_raw<std::int16_t>(builder, reader);
+    case binary::tag::int32: return run ? render_run<std::int32_t>(builder, reader) : render_raw<std::int32_t>(builder, reader);
+    case binary::tag::int64: return run ? render_run<std::int64_t>(builder, reader) : render_raw<std::int64_t>(builder, reader);
+    case binary::tag::uint16: return run ? render_run<std::uint16_t>(builder, reader) : render_raw<std::uint16_t>(builder, reader);
+    case binary::tag::uint32: return run ? render_run<std::uint32_t>(builder, reader) : render_raw<std::uint32_t>(builder, reader);
+    case binary::tag::uint64: return run ? render_run<std::uint64_t>(builder, reader) : render_raw<std::uint64_t>(builder, reader);
+    case binary::tag::float32: return run ? render_run<float>(builder, reader) : render_raw<float>(builder, reader);
+    case binary::tag::float64: return run ? render_run<double>(builder, reader) : render_raw<double>(builder, reader);
+    case binary::tag::long_double: return run ? render_run<long double>(builder, reader) : render_raw<long double>(builder, reader);
+    default: return false;
+    }
+}
+
+// Renders one encoded value, or one property name and its value, with `builder`. Nesting is tracked without
+// recursion, so that a malformed encoding can't overflow the stack.
+inline bool render_item(builder& builder, binary_reader& reader)
+{
+    std::vector<binary::tag> levels;
+    bool keyed = false;
+    do {
+        binary::tag tag;
+        if (!reader.read_tag(tag))
+            return false;
+        const bool element = !keyed && !levels.empty();
+        const char* data = nullptr;
+        std::size_t size = 0;
+        switch (tag) {
+        case binary::tag::null: builder.value(nullptr); break;
+        case binary::tag::false_value: builder.value(false); break;
+        case binary::tag::true_value: builder.value(true); break;
+        case binary::tag::character:
+            if (!render_raw<char>(builder, reader))
+                return false;
+            break;
+        case binary::tag::pointer:
+            if (!render_raw<const void*>(builder, reader))
+                return false;
+            break;
+        case binary::tag::string:
+            if (!reader.read_bytes(data, size))
+                return false;
+            builder.value(string_span{data, size});
+            break;
+        case binary::tag::truncated_string: {
+            std::size_t omitted = 0;
+            if (!reader.read_bytes(data, size) || !reader.read_length(omitted))
+                return false;
+            small_string text;
+            append_string(text, data, size, omitted);
+            builder.value(text_span{text.data(), text.size()});
+            break;
+        }
+        case binary::tag::text:
+            if (!reader.read_bytes(data, size))
+                return false;
+            builder.value(text_span{data, size});
+            break;
+        case binary::tag::name:
+            if (keyed || !reader.read_bytes(data, size))
+                return false;
+            builder.key(std::string(data, size));
+            keyed = true;
+            continue;
+        case binary::tag::begin_object:
+            builder.begin_object();
+            levels.push_back(binary::tag::end_object);
+            break;
+        case binary::tag::begin_array:
+            builder.begin_array();
+            levels.push_back(binary::tag::end_array);
+            break;
+        case binary::tag::end_object:
+        case binary::tag::end_array:
+            if (!element || levels.back() != tag)
+                return false;
+            if (tag == binary::tag::end_object)
+                builder.end_object();
+            else
+                builder.end_array();
+            levels.pop_back();
+            break;
+        case binary::tag::number_run:
+            if (!element || levels.back() != binary::tag::end_array || !reader.read_tag(tag) ||
+                !render_number(builder, reader, tag, true))
+                return false;
+            break;
+        case binary::tag::omitted:
+            if (!element || !reader.read_length(size))
+                return false;
+            builder.omitted(size);
+            break;
+        default:
+            if (!render_number(builder, reader, tag, false))
+                return false;
+            break;
+        }
+        keyed = false;
+    } while (keyed || !levels.empty());
+    return true;
+}
 
 } // namespace detail
 
-inline value::value(formatted_string formatted)
-    : formatted{std::move(formatted)}
+namespace binary {
+
+inline value::value(encoded_string encoded)
+    : encoded{std::move(encoded)}
 {}
 
 template <typename T>
 value::value(const T& value)
 {
-    static_assert(!std::is_same<property, T>::value, "A 'value' cannot be constructed from a 'property'");
-    static_assert(!std::is_same<prefix_string, T>::value, "A 'value' cannot be constructed from a 'prefix_string'");
-    static_assert(!std::is_same<formatted_string, T>::value, "A 'value' cannot be constructed from a 'formatted_string'");
-    std::ostringstream stream;
-    detail::output_value(stream, value);
-    formatted.underlying = stream.str();
+    static_assert(!std::is_same<property, T>::value, "A 'binary::value' cannot be constructed from a 'binary::property'");
+    static_assert(!std::is_same<test_state::property, T>::value, "A 'binary::value' cannot be constructed from a 'property'");
+    static_assert(!std::is_same<prefix_string, T>::value, "A 'binary::value' cannot be constructed from a 'prefix_string'");
+    static_assert(!std::is_same<encoded_string, T>::value, "A 'binary::value' cannot be constructed from an 'encoded_string'");
+    detail::encode_value(encoded.underlying, value);
 }
 
 inline std::ostream& operator<<(std::ostream& stream, const value& value)
 {
-    return stream << value.formatted.underlying;
+    return stream << render(value);
+}
+
+inline value array(std::initializer_list<value> values)
+{
+    return array(values.begin(), values.end());
+}
+
+// Bools have no number tag, so contiguous bools are encoded one by one like other values.
+template <typename TIterator, typename TSentinel>
+value array(TIterator first_value, TSentinel last_value)
+{
+    return detail::encode_array(first_value, last_value, std::integral_constant<bool,
+        std::is_same<TIterator, TSentinel>::value && detail::is_contiguous_number_iterator<TIterator>::value &&
+        !std::is_same<typename std::iterator_traits<TIterator>::value_type, bool>::value>{});
+}
+
+template <typename TRange>
+value array(const TRange& values)
+{
+    return array(std::begin(values), std::end(values));
 }
 
-inline value object(property property)
+inline value object(const property& property)
 {
-    return value{formatted_string{detail::curly_bracket(property.formatted.underlying)}};
+    return object({property});
 }
 
 inline value object(std::initializer_list<property> properties)
@@ -151,19 +4716,24 @@ inline value object(std::initializer_list<property> properties)
     return object(properties.begin(), properties.end());
 }
 
-template <typename TIterator>
-value object(TIterator first_property, TIterator last_property)
+template <typename TIterator, typename TSentinel>
+value object(TIterator first_property, TSentinel last_property)
 {
-    static_assert(std::is_same<property, typename std::iterator_traits<TIterator>::value_type>::value, "Invalid 'property' iterator");
-    std::string list;
-    if (first_property != last_property) {
-        list += first_property->formatted.underlying;
-        for (auto it = first_property + 1; it != last_property; ++it) {
-            list += ", ";
-            list += it->formatted.underlying;
+    using element = typename std::iterator_traits<TIterator>::value_type;
+    static_assert(std::is_same<property, element>::value || detail::is_key_value<element>::value, "Invalid 'binary::property' or key/value pair iterator");
+    std::string encoded;
+    detail::encode_tag(encoded, tag::begin_object);
+    const auto max_elements = global_settings().max_elements;
+    for (std::size_t count = 0; first_property != last_property; ++first_property, ++count) {
+        if (count == max_elements) {
+            detail::encode_tag(encoded, tag::omitted);
+            detail::encode_length(encoded, detail::count_remaining(first_property, last_property));
+            break;
         }
+        detail::encode_property(encoded, *first_property);
     }
-    return value{formatted_string{detail::curly_bracket(list)}};
+    detail::encode_tag(encoded, tag::end_object);
+    return value{encoded_string{std::move(encoded)}};
 }
 
 template <typename TRange>
@@ -172,176 +4742,542 @@ value object(const TRange& properties)
     return object(std::begin(properties), std::end(properties));
 }
 
-inline value array(std::initializer_list<value> values)
+inline property::property(const std::string& name, const value& value)
 {
-    return array(values.begin(), values.end());
+    encoded.underlying.reserve(name.size() + value.encoded.underlying.size() + 11);
+    detail::encode_name(encoded.underlying, name);
+    encoded.underlying += value.encoded.underlying;
 }
 
-template <typename TIterator>
-value array(TIterator first_value, TIterator last_value)
+inline output::output(prefix_string prefix)
+    : prefix{std::move(prefix)}
+{}
+
+template <typename T>
+output& output::add(const T& value)
+{
+    detail::encode_value(encoded.underlying, value);
+    return *this;
+}
+
+template <typename T>
+output& output::add(const std::string& name, const T& value)
 {
-    std::string list;
-    if (first_value != last_value) {
-        list += value{*first_value}.formatted.underlying;
-        for (auto it = first_value + 1; it != last_value; ++it) {
-            list += ", ";
-            list += value{*it}.formatted.underlying;
+    detail::encode_name(encoded.underlying, name);
+    detail::encode_value(encoded.underlying, value);
+    return *this;
+}
+
+inline std::ostream& operator<<(std::ostream& stream, const output& output)
+{
+    return stream << render(output);
+}
+
+inline output& operator+=(output& output, const value& value)
+{
+    output.encoded.underlying += value.encoded.underlying;
+    return output;
+}
+
+inline output& operator+=(output& output, value&& value)
+{
+    if (output.encoded.underlying.empty())
+        output.encoded = std::move(value.encoded);
+    else
+        output.encoded.underlying += value.encoded.underlying;
+    return output;
+}
+
+inline output& operator+=(output& output, const property& property)
+{
+    output.encoded.underlying += property.encoded.underlying;
+    return output;
+}
+
+inline output& operator+=(output& output, property&& property)
+{
+    if (output.encoded.underlying.empty())
+        output.encoded = std::move(property.encoded);
+    else
+        output.encoded.underlying += property.encoded.underlying;
+    return output;
+}
+
+inline bool render(test_state::output& target, const char* encoded, std::size_t size)
+{
+    detail::binary_reader reader{encoded, size};
+    builder builder{target};
+    while (!reader.at_end()) {
+        const auto entry_begin = target.formatted.underlying.size();
+        const auto omitted_bytes = target.omitted_bytes;
+        if (!detail::render_item(builder, reader)) {
+            target.formatted.underlying.resize(entry_begin);
+            target.omitted_bytes = omitted_bytes;
+            return false;
         }
     }
-    return value{formatted_string{detail::square_bracket(list)}};
+    return true;
 }
 
-template <typename TRange>
-value array(const TRange& values)
+inline test_state::value render(const value& value)
 {
-    return array(std::begin(values), std::end(values));
+    detail::binary_reader reader{value.encoded.underlying.data(), value.encoded.underlying.size()};
+    builder builder;
+    detail::render_item(builder, reader);
+    return builder.release();
 }
 
-inline property::property(const std::string& name, const value& value)
+inline test_state::output render(const output& output)
 {
-    formatted.underlying += detail::quote(name);
-    formatted.underlying += ": ";
-    formatted.underlying += value.formatted.underlying;
+    test_state::output rendered{output.prefix};
+    render(rendered, output.encoded.underlying.data(), output.encoded.underlying.size());
+    return rendered;
 }
 
-inline std::ostream& operator<<(std::ostream& stream, const property& property)
+} // namespace binary
+
+#if !defined(_WIN32)
+
+namespace detail {
+
+constexpr char mapped_log_magic[8] = {'j', 'g', 't', 's', 'l', 'o', 'g', '1'};
+constexpr std::size_t mapped_log_header_size = 16; // The magic number and the committed byte count
+
+// The committed byte count is the only state shared with readers, which may be other processes, so it's
+// stored with release semantics after the bytes of each entry. The mapping is page aligned, so the count is
+// aligned too.
+inline std::atomic<std::uint64_t>& committed_bytes(char* mapping)
 {
-    return stream << property.formatted.underlying;
+    return *reinterpret_cast<std::atomic<std::uint64_t>*>(mapping + sizeof(mapped_log_magic));
 }
 
-inline prefix_string google_test_prefix()
+inline bool map_log(mapped_output& output, std::size_t capacity)
 {
-    return prefix_string{"[    STATE ] "};
+    if (::ftruncate(output.descriptor, static_cast<off_t>(capacity)) != 0)
+        return false;
+    void* const mapping = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, output.descriptor, 0);
+    if (mapping == MAP_FAILED)
+        return false;
+    if (output.mapping)
+        ::munmap(output.mapping, output.capacity);
+    output.mapping = static_cast<char*>(mapping);
+    output.capacity = capacity;
+    return true;
 }
 
-inline output::output(prefix_string prefix)
+inline void append_mapped(mapped_output& output, const small_string& entry)
+{
+    if (!output.mapping)
+        return;
+    const auto committed = static_cast<std::size_t>(committed_bytes(output.mapping).load(std::memory_order_relaxed));
+    const auto end = mapped_log_header_size + committed + entry.size();
+    if (end > output.capacity) {
+        auto capacity = output.capacity * 2;
+        while (capacity < end)
+            capacity *= 2;
+        if (!map_log(output, capacity))
+            return;
+    }
+    std::memcpy(output.mapping + mapped_log_header_size + committed, entry.data(), entry.size());
+    committed_bytes(output.mapping).store(committed + entry.size(), std::memory_order_release);
+}
+
+// Appends the entry in `scratch`, limited like `limit_entry` limits the entries of an `output`. Once the log is
+// truncated, its marker is uncommitted before it's rewritten, so a crash can't leave a partly written marker.
+inline void append_limited(mapped_output& output)
+{
+    if (!output.mapping)
+        return;
+    auto& entry = output.scratch;
+    const auto max_output_bytes = global_settings().max_output_bytes;
+    const auto committed = static_cast<std::size_t>(committed_bytes(output.mapping).load(std::memory_order_relaxed));
+    if (output.omitted_bytes > 0) {
+        const auto marker_begin = committed - omitted_chars(output.omitted_bytes);
+        committed_bytes(output.mapping).store(marker_begin, std::memory_order_release);
+        output.omitted_bytes += entry.size();
+        entry.clear();
+        append_omitted(entry, output.omitted_bytes);
+    } else if (committed + entry.size() > max_output_bytes) {
+        const auto kept = utf8_boundary(entry.data(), max_output_bytes - committed);
+        output.omitted_bytes = entry.size() - kept;
+        entry.resize(kept);
+        append_omitted(entry, output.omitted_bytes);
+    }
+    append_mapped(output, entry);
+}
+
+} // namespace detail
+
+inline mapped_output::mapped_output(const std::string& path, prefix_string prefix, std::size_t capacity)
     : prefix{std::move(prefix)}
-{}
+{
+    descriptor = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (descriptor < 0)
+        return;
+    if (!detail::map_log(*this, capacity < detail::mapped_log_header_size ? detail::mapped_log_header_size : capacity))
+        return;
+    std::memcpy(mapping, detail::mapped_log_magic, sizeof(detail::mapped_log_magic));
+    new (mapping + sizeof(detail::mapped_log_magic)) std::atomic<std::uint64_t>{0};
+}
 
-inline output::output(const value& value)
+inline mapped_output::~mapped_output()
 {
-    *this += value;
+    if (mapping) {
+        const auto committed = detail::committed_bytes(mapping).load(std::memory_order_relaxed);
+        ::munmap(mapping, capacity);
+        if (::ftruncate(descriptor, static_cast<off_t>(detail::mapped_log_header_size + committed)) != 0) {
+            // The entries are intact, the file just keeps its unused capacity.
+        }
+    }
+    if (descriptor >= 0)
+        ::close(descriptor);
 }
 
-inline output::output(const property& property)
+template <typename T>
+mapped_output& mapped_output::add(const T& value)
 {
-    *this += property;
+    scratch.clear();
+    if (mapped() && detail::committed_bytes(mapping).load(std::memory_order_relaxed) > 0)
+        scratch += '\n';
+    scratch += prefix.underlying;
+    {
+        JG_TEST_STATE_FORMATTING(scratch, true);
+        detail::format_value(scratch, value);
+    }
+    detail::append_limited(*this);
+    return *this;
 }
 
-inline output::output(prefix_string prefix, const property& property)
-    : prefix{std::move(prefix)}
+template <typename T>
+mapped_output& mapped_output::add(const std::string& name, const T& value)
 {
-    *this += property;
+    scratch.clear();
+    if (mapped() && detail::committed_bytes(mapping).load(std::memory_order_relaxed) > 0)
+        scratch += '\n';
+    scratch += prefix.underlying;
+    {
+        JG_TEST_STATE_FORMATTING(scratch, true);
+        detail::append_quoted(scratch, name);
+        scratch += ": ";
+        detail::format_value(scratch, value);
+    }
+    detail::append_limited(*this);
+    return *this;
 }
 
-inline output::output(prefix_string prefix, const value& value)
-    : prefix{std::move(prefix)}
+inline bool mapped_output::mapped() const
 {
-    *this += value;
+    return mapping != nullptr;
 }
 
-inline std::ostream& operator<<(std::ostream& stream, const output& output)
+inline std::ostream& operator<<(std::ostream& stream, const mapped_output& output)
 {
-    return stream << output.formatted.underlying;
+    if (output.mapped())
+        stream.write(output.mapping + detail::mapped_log_header_size,
+                     static_cast<std::streamsize>(detail::committed_bytes(output.mapping).load(std::memory_order_acquire)));
+    return stream;
 }
 
-inline output& operator+=(output& output, const property& property)
+inline mapped_output& operator+=(mapped_output& output, const value& value)
 {
-    if (!output.formatted.underlying.empty())
-        output.formatted.underlying += '\n';
-    output.formatted.underlying += output.prefix.underlying;
-    output.formatted.underlying += property.formatted.underlying;
-    return output;
+    return output.add(value);
 }
 
-inline output& operator+=(output& output, const value& value)
+inline mapped_output& operator+=(mapped_output& output, const property& property)
 {
-    if (!output.formatted.underlying.empty())
-        output.formatted.underlying += '\n';
-    output.formatted.underlying += output.prefix.underlying;
-    output.formatted.underlying += value.formatted.underlying;
-    return output;
+    return output.add(property);
+}
+
+inline bool read_mapped_log(const std::string& path, std::string& entries)
+{
+    const int descriptor = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (descriptor < 0)
+        return false;
+    std::string contents;
+    char block[4096];
+    for (;;) {
+        const auto size = ::read(descriptor, block, sizeof(block));
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            break;
+        contents.append(block, static_cast<std::size_t>(size));
+    }
+    ::close(descriptor);
+    return read_mapped_log(contents.data(), contents.size(), entries);
+}
+
+inline bool read_mapped_log(const char* data, std::size_t size, std::string& entries)
+{
+    if (size < detail::mapped_log_header_size ||
+        std::memcmp(data, detail::mapped_log_magic, sizeof(detail::mapped_log_magic)) != 0)
+        return false;
+    std::uint64_t committed = 0;
+    std::memcpy(&committed, data + sizeof(detail::mapped_log_magic), sizeof(committed));
+    if (committed > size - detail::mapped_log_header_size)
+        return false;
+    entries.assign(data + detail::mapped_log_header_size, static_cast<std::size_t>(committed));
+    return true;
 }
 
+#endif
+
 namespace detail {
 
-inline std::string surround(const std::string& text, const std::string& left, const std::string& right, const std::string& fill)
+class new_delete_memory final : public memory_resource
+{
+public:
+    void* allocate(std::size_t size, std::size_t /*alignment*/) override
+    {
+        return ::operator new(size);
+    }
+
+    void deallocate(void* memory, std::size_t /*size*/, std::size_t /*alignment*/) noexcept override
+    {
+        ::operator delete(memory);
+    }
+};
+
+inline memory_resource*& thread_resource()
+{
+    thread_local memory_resource* resource = nullptr;
+    return resource;
+}
+
+} // namespace detail
+
+// Never destroyed, since text in objects with static and thread storage duration is deallocated to it.
+inline memory_resource& new_delete_resource()
+{
+    static memory_resource* const resource = new detail::new_delete_memory;
+    return *resource;
+}
+
+inline memory_resource& current_resource()
+{
+    auto* const resource = detail::thread_resource();
+    return resource ? *resource : new_delete_resource();
+}
+
+inline monotonic_resource::monotonic_resource(std::size_t initial_size, memory_resource& upstream)
+    : upstream{upstream}
+    , buffer{nullptr}
+    , buffer_size{0}
+    , current{nullptr}
+    , remaining{0}
+    , next_size{initial_size > sizeof(block) ? initial_size : 2 * sizeof(block)}
+{}
+
+inline monotonic_resource::monotonic_resource(void* buffer, std::size_t size, memory_resource& upstream)
+    : upstream{upstream}
+    , buffer{static_cast<char*>(buffer)}
+    , buffer_size{size}
+    , current{static_cast<char*>(buffer)}
+    , remaining{size}
+    , next_size{size > sizeof(block) ? 2 * size : 2 * sizeof(block)}
+{}
+
+inline monotonic_resource::~monotonic_resource()
+{
+    release();
+}
+
+inline void* monotonic_resource::allocate(std::size_t size, std::size_t alignment)
 {
-    std::string surrounded{left};
-    if (!text.empty()) {
-        surrounded += fill;
-        surrounded += text;
-        surrounded += fill;
+    std::lock_guard<std::mutex> lock{mutex};
+    auto padding = static_cast<std::size_t>(-reinterpret_cast<std::uintptr_t>(current) & (alignment - 1));
+    if (!current || padding + size > remaining) {
+        while (next_size < sizeof(block) + alignment + size)
+            next_size *= 2;
+        auto* const allocated = static_cast<block*>(upstream.allocate(next_size, alignof(block)));
+        *allocated = {blocks, next_size};
+        blocks = allocated;
+        current = reinterpret_cast<char*>(allocated + 1);
+        remaining = next_size - sizeof(block);
+        next_size *= 2;
+        padding = static_cast<std::size_t>(-reinterpret_cast<std::uintptr_t>(current) & (alignment - 1));
     }
-    surrounded += right;
-    return surrounded;
+    char* const memory = current + padding;
+    current = memory + size;
+    remaining -= padding + size;
+    allocated_bytes += size;
+    return memory;
 }
 
-inline std::string curly_bracket(const std::string& text)
+inline void monotonic_resource::deallocate(void* /*memory*/, std::size_t /*size*/, std::size_t /*alignment*/) noexcept
+{}
+
+inline void monotonic_resource::release() noexcept
 {
-    return surround(text, "{", "}", " ");
+    std::lock_guard<std::mutex> lock{mutex};
+    while (blocks) {
+        auto* const next = blocks->next;
+        upstream.deallocate(blocks, blocks->size, alignof(block));
+        blocks = next;
+    }
+    current = buffer;
+    remaining = buffer_size;
+    allocated_bytes = 0;
 }
 
-inline std::string square_bracket(const std::string& text)
+inline std::size_t monotonic_resource::allocated() const
 {
-    return surround(text, "[", "]", " ");
+    std::lock_guard<std::mutex> lock{mutex};
+    return allocated_bytes;
 }
 
-inline std::string quote(const std::string& text)
+inline scoped_resource::scoped_resource(memory_resource& resource)
+    : previous{detail::thread_resource()}
 {
-    return surround(text, "\"", "\"", "");
+    detail::thread_resource() = &resource;
 }
 
-template <typename T>
-void output_value(std::ostream& stream, const T& value)
+inline scoped_resource::~scoped_resource()
 {
-    stream << value;
+    detail::thread_resource() = previous;
 }
 
-inline void output_value(std::ostream& stream, const std::string& value)
+#if defined(JG_TEST_STATE_STATS)
+
+namespace detail {
+
+struct statistics_registry final
 {
-    stream << quote(value);
+    std::mutex mutex;
+    std::vector<const statistics_counters*> threads;
+    statistics exited{}; // Sum of the counters of threads that have exited
+};
+
+inline statistics_registry& global_statistics_registry()
+{
+    static statistics_registry registry;
+    return registry;
 }
 
-template <typename T>
-inline void output_value(std::ostream& stream, T* value)
+inline void add_statistics(statistics& sum, const statistics_counters& counters)
 {
-    output_value(stream, const_cast<const T*>(value));
+    sum.fast_values += counters.fast_values.load(std::memory_order_relaxed);
+    sum.stream_values += counters.stream_values.load(std::memory_order_relaxed);
+    sum.formatted_bytes += counters.formatted_bytes.load(std::memory_order_relaxed);
+    sum.allocations += counters.allocations.load(std::memory_order_relaxed);
+    sum.appended_entries += counters.appended_entries.load(std::memory_order_relaxed);
+    sum.streamed_entries += counters.streamed_entries.load(std::memory_order_relaxed);
+    sum.formatting_nanoseconds += counters.formatting_nanoseconds.load(std::memory_order_relaxed);
 }
 
-template <typename T>
-inline void output_value(std::ostream& stream, const T* value)
+// The counters of a thread, which are registered while the thread runs, and added to the sum of the exited
+// threads when it exits.
+struct registered_counters final
 {
-    if (value)
-        stream << "0x"
-               << std::hex
-               << std::setw(sizeof(T*) * 2) // two hex chars per byte
-               << std::setfill('0')
-               << reinterpret_cast<std::uintptr_t>(value);
-    else
-        stream << "null";
+    registered_counters()
+    {
+        auto& registry = global_statistics_registry();
+        std::lock_guard<std::mutex> lock{registry.mutex};
+        registry.threads.push_back(&counters);
+    }
+
+    ~registered_counters()
+    {
+        auto& registry = global_statistics_registry();
+        std::lock_guard<std::mutex> lock{registry.mutex};
+        add_statistics(registry.exited, counters);
+        registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), &counters));
+    }
+
+    statistics_counters counters;
+};
+
+inline statistics_counters& thread_statistics()
+{
+    thread_local registered_counters registered;
+    return registered.counters;
 }
 
-inline void output_value(std::ostream& stream, std::nullptr_t)
+inline formatting_scope::formatting_scope(const small_string& buffer, bool is_entry)
+    : counters{thread_statistics()}
+    , buffer{buffer}
+    , begin{buffer.size()}
+    , stream_formats{counters.stream_formats}
+    , start{counters.depth == 0 ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{}}
+    , is_entry{is_entry}
 {
-    stream << "null";
+    ++counters.depth;
 }
 
-inline void output_value(std::ostream& stream, char* value)
+inline formatting_scope::~formatting_scope()
 {
-    stream << quote(value);
+    if (--counters.depth > 0)
+        return;
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    count(counters.formatting_nanoseconds, static_cast<std::uint64_t>(elapsed.count()));
+    count(counters.formatted_bytes, buffer.size() > begin ? buffer.size() - begin : 0);
+    count(counters.stream_formats != stream_formats ? counters.stream_values : counters.fast_values, 1);
+    if (is_entry)
+        count(counters.appended_entries, 1);
 }
 
-inline void output_value(std::ostream& stream, const char* value)
+// Formats without counting, since it's also done when the process exits, after the counters of the thread
+// have been destroyed.
+inline std::string format_statistics(const statistics& statistics)
 {
-    stream << quote(value);
+    const std::pair<const char*, std::uint64_t> counters[] = {
+        {"fast_values", statistics.fast_values},
+        {"stream_values", statistics.stream_values},
+        {"formatted_bytes", statistics.formatted_bytes},
+        {"allocations", statistics.allocations},
+        {"appended_entries", statistics.appended_entries},
+        {"streamed_entries", statistics.streamed_entries},
+        {"formatting_nanoseconds", statistics.formatting_nanoseconds},
+    };
+    std::string text = "{";
+    for (const auto& counter : counters) {
+        char number[max_integer_chars];
+        text += text.size() > 1 ? ", \"" : " \"";
+        text += counter.first;
+        text += "\": ";
+        text.append(number, write_integer(number, counter.second));
+    }
+    text += " }";
+    return text;
 }
 
-inline void output_value(std::ostream& stream, bool value)
+inline std::FILE*& statistics_file()
 {
-    stream << std::boolalpha << value;
+    static std::FILE* file = nullptr;
+    return file;
 }
 
 } // namespace detail
+
+inline statistics collect_statistics()
+{
+    auto& registry = detail::global_statistics_registry();
+    std::lock_guard<std::mutex> lock{registry.mutex};
+    auto sum = registry.exited;
+    for (const auto* counters : registry.threads)
+        detail::add_statistics(sum, *counters);
+    return sum;
+}
+
+inline value object(const statistics& statistics)
+{
+    const auto text = detail::format_statistics(statistics);
+    return value{formatted_string{detail::small_string{text}}};
+}
+
+inline void dump_statistics_at_exit(std::FILE* file)
+{
+    detail::global_statistics_registry(); // Constructed before the handler is registered, so destroyed after it runs
+    if (detail::statistics_file())
+        return;
+    detail::statistics_file() = file;
+    std::atexit([] {
+        const auto text = detail::format_statistics(collect_statistics());
+        std::fprintf(detail::statistics_file(), "%s\n", text.c_str());
+    });
+}
+
+#endif
+
 } // namespace test_state
 } // namespace jg
@@ -1,11 +1,63 @@
+#undef NDEBUG // The tests are asserts, so keep them in release builds
 #include <iostream>
 #include <cassert>
+#include <iomanip>
 #include <string>
 #include <vector>
+#include <array>
+#include <list>
+#include <forward_list>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <iterator>
+#include <limits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <clocale>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#if !defined(_WIN32)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 #include <jg_test_state.h>
 
 using namespace jg::test_state;
 
+// Allocation accounting for the tests of moves.
+
+static std::atomic<std::size_t> allocation_count{0}; // Threads of other tests allocate too
+
+// GCC pairs the std::free() below with operator new instead of std::malloc() once both are inlined.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(std::size_t size)
+{
+    ++allocation_count;
+    if (void* memory = std::malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
 template <typename T>
 static std::string to_string(const T& value)
 {
@@ -1068,21 +1120,1837 @@ static void test_property()
     }
 }
 
-int main()
+#if !defined(_WIN32)
+// Returns whether calling `function` aborts, like a failed assert does, in a child process.
+template <typename Function>
+static bool aborts(Function function)
 {
-    test_value();
-    test_property();
+    const pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        static_cast<void>(std::freopen("/dev/null", "w", stderr)); // Keeps the failed assert out of the test output
+        function();
+        std::_Exit(0);
+    }
+    int status = 0;
+    assert(waitpid(child, &status, 0) == child);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+#endif
 
-    test_user_defined_type();
-    test_user_defined_output();
+static void test_builder()
+{
+    {
+        builder builder;
+        builder.begin_object()
+               .key("points").begin_array()
+                   .value(vector2d{1,2})
+                   .value(vector2d{3,4})
+               .end_array()
+               .key("empty").begin_object().end_object()
+               .key("count").value(2)
+               .end_object();
 
-    test_object();
-    test_array();
-    test_prefix();
+        assert(to_string(builder.release()) == R"({ "points": [ (1,2), (3,4) ], "empty": {}, "count": 2 })");
+    }
 
-    test_ctors_simple_value();
-    test_static_ctors_simple_value();
-    test_ctors_complex_value();
-    test_ctors_simple_property();
-    test_ctors_complex_property();
+    {
+        builder builder;
+        builder.begin_array()
+               .value(array({1, 2}))
+               .property({"one", 1})
+               .begin_array().end_array()
+               .end_array();
+
+        assert(to_string(builder.release()) == R"([ [ 1, 2 ], "one": 1, [] ])");
+    }
+
+    {
+        output state{prefix_string{"prefix: "}};
+        state += 1;
+
+        builder builder{state};
+        builder.begin_object().key("x").value(2).end_object();
+        builder.key("y").value(3);
+        builder.value("foo");
+
+        assert(to_string(state) == "prefix: 1\nprefix: { \"x\": 2 }\nprefix: \"y\": 3\nprefix: \"foo\"");
+    }
+
+    {
+        const int depth = 8;
+        builder builder;
+        for (int i = 0; i < depth; ++i)
+            builder.begin_array().value(i);
+        for (int i = 0; i < depth; ++i)
+            builder.end_array();
+
+        assert(to_string(builder.release()) == "[ 0, [ 1, [ 2, [ 3, [ 4, [ 5, [ 6, [ 7 ] ] ] ] ] ] ] ]");
+    }
+
+#if !defined(_WIN32)
+    {
+        // Objects and arrays are balanced when the builder is released
+        assert(aborts([] { builder{}.end_object(); }));
+        assert(aborts([] { builder{}.begin_array().release(); }));
+        assert(!aborts([] { builder{}.begin_array().end_array().release(); }));
+    }
+#endif
+}
+
+static void test_scalar_formatting()
+{
+    {
+        assert(to_string(value{0}) == "0");
+        assert(to_string(value{-1}) == "-1");
+        assert(to_string(value{static_cast<short>(-32768)}) == "-32768");
+        assert(to_string(value{static_cast<unsigned short>(65535)}) == "65535");
+        assert(to_string(value{std::numeric_limits<std::int64_t>::min()}) == "-9223372036854775808");
+        assert(to_string(value{std::numeric_limits<std::int64_t>::max()}) == "9223372036854775807");
+        assert(to_string(value{std::numeric_limits<std::uint64_t>::max()}) == "18446744073709551615");
+        assert(to_string(value{std::numeric_limits<std::int32_t>::min()}) == "-2147483648");
+
+        for (long long i = -100000; i <= 100000; i += 7)
+            assert(to_string(value{i}) == to_string(i));
+        for (unsigned long long i = 1; i != 0 && i < std::numeric_limits<unsigned long long>::max() / 3; i *= 3)
+            assert(to_string(value{i}) == to_string(i));
+    }
+
+    {
+        assert(to_string(value{'a'}) == "a");
+        assert(to_string(value{static_cast<signed char>('b')}) == "b");
+        assert(to_string(value{static_cast<unsigned char>('c')}) == "c");
+    }
+
+    {
+        const settings original = global_settings();
+        global_settings().floating_point = floating_point_format::precision;
+
+        const double doubles[] { 0.0, -0.0, 1.0, -1.5, 3.1415926, 1e-10, 123456789.0, 1e300, -2.5e-300,
+                                 std::numeric_limits<double>::infinity() };
+        for (const double d : doubles)
+            assert(to_string(value{d}) == to_string(d));
+
+        const float floats[] { 0.0f, 0.1f, -3.1415926f, 1e20f, 65504.0f };
+        for (const float f : floats)
+            assert(to_string(value{f}) == to_string(f));
+
+        const long double ld = 2.718281828L;
+        assert(to_string(value{ld}) == to_string(ld));
+
+        global_settings() = original;
+    }
+
+    {
+        char text[] = "text";
+        assert(to_string(value{text}) == R"("text")");
+        assert(to_string(value{static_cast<char*>(text)}) == R"("text")");
+        assert(to_string(value{static_cast<const char*>(text)}) == R"("text")");
+        assert(to_string(value{std::string{}}) == R"("")");
+    }
+
+    {
+        const int* null = nullptr;
+        assert(to_string(value{null}) == "null");
+
+        std::ostringstream stream;
+        detail::output_value(stream, true);
+        detail::output_value(stream, reinterpret_cast<const void*>(std::uintptr_t{0x10}));
+        stream << ' ' << 10;
+        assert(stream.str() == "true0x0000000000000010 10");
+    }
+}
+
+static void test_floating_point()
+{
+    {
+        assert(to_string(value{0.1}) == "0.1");
+        assert(to_string(value{0.1 + 0.2}) == "0.30000000000000004");
+        assert(to_string(value{3.1415926}) == "3.1415926");
+        assert(to_string(value{100.0}) == "100");
+        assert(to_string(value{1e15}) == "1000000000000000");
+        assert(to_string(value{1e16}) == "1e+16");
+        assert(to_string(value{0.0001}) == "0.0001");
+        assert(to_string(value{0.00001}) == "1e-05");
+        assert(to_string(value{1e23}) == "1e+23");
+        assert(to_string(value{5e-324}) == "5e-324");
+        assert(to_string(value{std::numeric_limits<double>::max()}) == "1.7976931348623157e+308");
+        assert(to_string(value{0.1f}) == "0.1");
+        assert(to_string(value{16777216.0f}) == "16777216");
+        assert(to_string(value{1e-45f}) == "1e-45");
+        assert(to_string(value{std::numeric_limits<float>::max()}) == "3.4028235e+38");
+        assert(to_string(value{-0.0}) == "-0");
+        assert(to_string(value{-std::numeric_limits<double>::infinity()}) == "-inf");
+        assert(to_string(value{std::numeric_limits<double>::quiet_NaN()}) == "nan");
+        assert(to_string(value{2.5L}) == "2.5");
+    }
+
+    {
+        // Every formatted value reads back as itself, also when the shortest digits take the slower search.
+        std::uint64_t state = 4711;
+        for (int i = 0; i < 100000; ++i) {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            double d;
+            float f;
+            const auto bits = state >> 1;
+            const auto float_bits = static_cast<std::uint32_t>(state >> 33);
+            std::memcpy(&d, &bits, sizeof(d));
+            std::memcpy(&f, &float_bits, sizeof(f));
+            if (std::isfinite(d))
+                assert(std::strtod(to_string(value{d}).c_str(), nullptr) == d);
+            if (std::isfinite(f))
+                assert(std::strtof(to_string(value{f}).c_str(), nullptr) == f);
+        }
+    }
+
+    const settings original = global_settings();
+
+    {
+        global_settings().floating_point = floating_point_format::precision;
+        global_settings().floating_point_precision = 3;
+        assert(to_string(value{3.1415926}) == "3.14");
+        assert(to_string(value{1234.5}) == "1.23e+03");
+        global_settings().floating_point_precision = 100;
+        assert(to_string(value{0.1}) == "0.10000000000000001");
+        global_settings() = original;
+    }
+
+    {
+        global_settings().floating_point = floating_point_format::hex;
+        assert(to_string(value{1.5}) == "0x1.8p+0");
+        assert(to_string(value{-0.5f}) == "-0x1p-1");
+        assert(to_string(value{0.1}) == "0x1.999999999999ap-4");
+        assert(to_string(value{0.0}) == "0x0p+0");
+        assert(to_string(value{5e-324}) == "0x0.0000000000001p-1022");
+        assert(to_string(value{std::numeric_limits<double>::max()}) == "0x1.fffffffffffffp+1023");
+        global_settings() = original;
+    }
+
+    // The output doesn't follow the decimal point of the C locale.
+    if (std::setlocale(LC_ALL, "de_DE.UTF-8") || std::setlocale(LC_ALL, "de_DE") || std::setlocale(LC_ALL, "fr_FR.UTF-8")) {
+        assert(to_string(value{0.5}) == "0.5");
+        assert(to_string(value{1e300}) == "1e+300");
+        global_settings().floating_point = floating_point_format::precision;
+        assert(to_string(value{2.5}) == "2.5");
+        global_settings().floating_point = floating_point_format::hex;
+        assert(to_string(value{1.5}) == "0x1.8p+0");
+        global_settings() = original;
+        std::setlocale(LC_ALL, "C");
+    }
+}
+
+struct counted_format
+{
+    int* count;
+};
+
+static std::ostream& operator<<(std::ostream& stream, const counted_format& c)
+{
+    ++*c.count;
+    return stream << "counted";
+}
+
+struct large_state
+{
+    char bytes[256];
+    int id;
+};
+
+static std::ostream& operator<<(std::ostream& stream, const large_state& s)
+{
+    return stream << "large" << s.id;
+}
+
+static void test_deferred_output()
+{
+    {
+        int count = 0;
+        deferred_output state{prefix_string{"prefix: "}};
+        state += counted_format{&count};
+        state.add("name", counted_format{&count});
+        assert(count == 0);
+
+        assert(to_string(state) == "prefix: counted\nprefix: \"name\": counted");
+        assert(count == 2);
+
+        assert(to_string(state) == "prefix: counted\nprefix: \"name\": counted");
+        assert(count == 2);
+
+        state += 4711;
+        assert(to_string(state) == "prefix: counted\nprefix: \"name\": counted\nprefix: 4711");
+        assert(count == 2);
+    }
+
+    {
+        deferred_output state;
+        {
+            char text[] = "temporary";
+            state += text;
+            state.add("text", static_cast<const char*>(text));
+            text[0] = 'X';
+        }
+        state += std::string{"moved"};
+        state += {"one", 1};
+        state += object({{"two", 2}});
+        state.add("array", array({1, 2}));
+
+        assert(to_string(state) == R"("temporary"
+"text": "temporary"
+"moved"
+"one": 1
+{ "two": 2 }
+"array": [ 1, 2 ])");
+    }
+
+    {
+        large_state big{};
+        big.id = 7;
+
+        deferred_output state;
+        state += big;
+        state.add("big", big);
+        big.id = 8;
+
+        deferred_output moved{std::move(state)};
+        assert(to_string(moved) == "large7\n\"big\": large7");
+    }
+
+    {
+        deferred_output state;
+        assert(to_string(state).empty());
+    }
+}
+
+struct hex_number
+{
+    int number;
+};
+
+static std::ostream& operator<<(std::ostream& stream, const hex_number& h)
+{
+    return stream << std::hex << std::showbase << std::setw(6) << std::setfill('.') << h.number;
+}
+
+struct nested_state
+{
+    vector2d position;
+};
+
+static std::ostream& operator<<(std::ostream& stream, const nested_state& s)
+{
+    return stream << "nested" << value{s.position} << object({{"p", s.position}});
+}
+
+struct stateful_format
+{
+};
+
+static const int stateful_index = std::ios_base::xalloc();
+
+static std::ostream& operator<<(std::ostream& stream, const stateful_format&)
+{
+    return stream << stream.iword(stateful_index)++;
+}
+
+struct fresh_stateful_format
+{
+};
+
+static std::ostream& operator<<(std::ostream& stream, const fresh_stateful_format&)
+{
+    return stream << stream.iword(stateful_index)++;
+}
+
+namespace jg {
+namespace test_state {
+
+template <>
+struct reuse_stream<fresh_stateful_format> : std::false_type {};
+
+} // namespace test_state
+} // namespace jg
+
+struct long_text
+{
+    std::size_t length;
+};
+
+static std::ostream& operator<<(std::ostream& stream, const long_text& t)
+{
+    for (std::size_t i = 0; i < t.length; ++i)
+        stream << static_cast<char>('a' + i % 26);
+    return stream;
+}
+
+static void test_stream_reuse()
+{
+    {
+        output state = array({hex_number{255}, vector2d{10,11}, hex_number{16}, moving_particle{{1,2},{3,4}}});
+        assert(to_string(state) == "[ ..0xff, (10,11), ..0x10, pos(1,2),vel(3,4) ]");
+    }
+
+    {
+        output state;
+        for (int i = 0; i < 3; ++i)
+            state += vector2d{i, i};
+        assert(to_string(state) == "(0,0)\n(1,1)\n(2,2)");
+    }
+
+    {
+        output state{nested_state{{5,6}}};
+        assert(to_string(state) == R"(nested(5,6){ "p": (5,6) })");
+    }
+
+    {
+        value first{stateful_format{}};
+        value second{stateful_format{}};
+        assert(to_string(first) != to_string(second));
+
+        value fresh_first{fresh_stateful_format{}};
+        value fresh_second{fresh_stateful_format{}};
+        assert(to_string(fresh_first) == "0");
+        assert(to_string(fresh_second) == "0");
+    }
+
+    {
+        value v{long_text{1000}};
+        assert(to_string(v).size() == 1000);
+        assert(to_string(v).substr(0, 3) == "abc");
+        assert(to_string(v).substr(997) == "jkl");
+    }
+}
+
+template <typename T>
+static std::string to_general_array_string(const std::vector<T>& numbers)
+{
+    builder builder;
+    builder.begin_array();
+    for (const T& number : numbers)
+        builder.value(number);
+    builder.end_array();
+    return to_string(builder.release());
+}
+
+static void test_number_array()
+{
+    {
+        std::vector<int> ints;
+        for (int i = -1000; i <= 1000; i += 3)
+            ints.push_back(i * 4711);
+        ints.push_back(std::numeric_limits<int>::min());
+        ints.push_back(std::numeric_limits<int>::max());
+
+        assert(to_string(array(ints)) == to_general_array_string(ints));
+        assert(to_string(array(ints.cbegin(), ints.cend())) == to_general_array_string(ints));
+        assert(to_string(array(ints.data(), ints.data() + ints.size())) == to_general_array_string(ints));
+    }
+
+    {
+        const std::vector<std::uint64_t> uint64s { 0, 1, std::numeric_limits<std::uint64_t>::max() };
+        assert(to_string(array(uint64s)) == "[ 0, 1, 18446744073709551615 ]");
+
+        const std::vector<std::int64_t> int64s { std::numeric_limits<std::int64_t>::min(), -1 };
+        assert(to_string(array(int64s)) == "[ -9223372036854775808, -1 ]");
+
+        const short shorts[] { -32768, 32767 };
+        assert(to_string(array(shorts)) == "[ -32768, 32767 ]");
+    }
+
+    {
+        const settings original = global_settings();
+        global_settings().floating_point = floating_point_format::precision;
+
+        const std::vector<float> floats { 0.5f, -1e-30f, 3.1415926f, std::numeric_limits<float>::infinity() };
+        assert(to_string(array(floats)) == to_general_array_string(floats));
+
+        const std::vector<double> doubles { -1.7976931348623157e308, 2.2250738585072014e-308, -0.0 };
+        assert(to_string(array(doubles)) == to_general_array_string(doubles));
+
+        const long double long_doubles[] { -1.18973e+4932L, 1.0L };
+        assert(to_string(array(long_doubles)) == "[ -1.18973e+4932, 1 ]");
+
+        global_settings() = original;
+    }
+
+    {
+        const std::vector<float> floats { 0.5f, -1e-30f, 3.1415926f, std::numeric_limits<float>::infinity() };
+        assert(to_string(array(floats)) == "[ 0.5, -1e-30, 3.1415925, inf ]");
+
+        const std::vector<double> doubles { -1.7976931348623157e308, 2.2250738585072014e-308, -0.0 };
+        assert(to_string(array(doubles)) == "[ -1.7976931348623157e+308, 2.2250738585072014e-308, -0 ]");
+    }
+
+    {
+        const bool bools[] { true, false, true };
+        assert(to_string(array(bools)) == "[ true, false, true ]");
+
+        const std::vector<bool> bool_vector { false, true };
+        assert(to_string(array(bool_vector)) == "[ false, true ]");
+    }
+
+    {
+        const std::vector<double> empty;
+        assert(to_string(array(empty)) == "[]");
+        assert(to_string(array(empty.begin(), empty.end())) == "[]");
+
+        const std::vector<char> chars { 'a', 'b' };
+        assert(to_string(array(chars)) == "[ a, b ]");
+    }
+}
+
+// Single-pass input iterator that produces the squares of 1, 2, 3, ... until it's equal to a count sentinel.
+struct square_generator
+{
+    using iterator_category = std::input_iterator_tag;
+    using value_type = int;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const int*;
+    using reference = int;
+
+    int current;
+
+    int operator*() const { return current * current; }
+    square_generator& operator++() { ++current; return *this; }
+};
+
+struct generator_end
+{
+    int count;
+};
+
+static bool operator!=(const square_generator& it, const generator_end& end)
+{
+    return it.current <= end.count;
+}
+
+struct property_generator
+{
+    using iterator_category = std::input_iterator_tag;
+    using value_type = property;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const property*;
+    using reference = property;
+
+    int current;
+
+    property operator*() const { return {std::string(1, static_cast<char>('a' + current)), current}; }
+    property_generator& operator++() { ++current; return *this; }
+};
+
+static bool operator!=(const property_generator& it, const generator_end& end)
+{
+    return it.current < end.count;
+}
+
+struct square_range
+{
+    int count;
+
+    square_generator begin() const { return {1}; }
+    generator_end end() const { return {count}; }
+};
+
+static void test_input_iterators()
+{
+    {
+        const std::list<std::string> names { "alpha", "bravo" };
+        assert(to_string(array(names)) == R"([ "alpha", "bravo" ])");
+        assert(to_string(array(names.begin(), names.end())) == R"([ "alpha", "bravo" ])");
+
+        const std::set<int> numbers { 3, 1, 2 };
+        assert(to_string(array(numbers)) == "[ 1, 2, 3 ]");
+
+        const std::forward_list<vector2d> points { {1,2}, {3,4} };
+        assert(to_string(array(points)) == "[ (1,2), (3,4) ]");
+
+        const std::list<property> properties { {"one", 1}, {"two", 2} };
+        assert(to_string(object(properties)) == R"({ "one": 1, "two": 2 })");
+        assert(to_string(object(properties.begin(), properties.end())) == R"({ "one": 1, "two": 2 })");
+    }
+
+    {
+        std::istringstream input{"1 2 3"};
+        const value numbers = array(std::istream_iterator<int>{input}, std::istream_iterator<int>{});
+        assert(to_string(numbers) == "[ 1, 2, 3 ]");
+    }
+
+    {
+        assert(to_string(array(square_generator{1}, generator_end{4})) == "[ 1, 4, 9, 16 ]");
+        assert(to_string(array(square_generator{1}, generator_end{0})) == "[]");
+        assert(to_string(array(square_range{3})) == "[ 1, 4, 9 ]");
+        assert(to_string(object(property_generator{0}, generator_end{2})) == R"({ "a": 0, "b": 1 })");
+    }
+}
+
+static void test_budgets()
+{
+    const settings original = global_settings();
+
+    {
+        global_settings().max_elements = 3;
+
+        const std::vector<int> ints { 1, 2, 3, 4, 5 };
+        assert(to_string(array(ints)) == "[ 1, 2, 3, ... (+2 more) ]");
+        assert(to_string(array(ints.data(), ints.data() + 3)) == "[ 1, 2, 3 ]");
+
+        const std::list<std::string> names { "a", "b", "c", "d" };
+        assert(to_string(array(names)) == R"([ "a", "b", "c", ... (+1 more) ])");
+
+        assert(to_string(array(square_generator{1}, generator_end{1000})) == "[ 1, 4, 9, ... (+997 more) ]");
+        assert(to_string(object(property_generator{0}, generator_end{5})) == R"({ "a": 0, "b": 1, "c": 2, ... (+2 more) })");
+        assert(to_string(object({{"a", 1}, {"b", 2}, {"c", 3}, {"d", 4}})) == R"({ "a": 1, "b": 2, "c": 3, ... (+1 more) })");
+
+        global_settings().max_elements = 0;
+        assert(to_string(array(ints)) == "[ ... (+5 more) ]");
+        assert(to_string(array(names)) == "[ ... (+4 more) ]");
+        assert(to_string(array(std::vector<int>{})) == "[]");
+
+        global_settings() = original;
+    }
+
+    {
+        global_settings().max_string_length = 5;
+
+        assert(to_string(value{"abcdefgh"}) == "\"abcde... (+3 more)\"");
+        assert(to_string(value{std::string{"abcde"}}) == R"("abcde")");
+        assert(to_string(property{"long property name", "abcdefgh"}) == "\"long property name\": \"abcde... (+3 more)\"");
+        assert(to_string(value{"abcd\xc3\xa5"}) == "\"abcd... (+2 more)\""); // Doesn't split the UTF-8 sequence
+
+        global_settings() = original;
+    }
+
+    {
+        global_settings().max_output_bytes = 10;
+
+        output state;
+        state += 12345;
+        state += 67890;
+        assert(to_string(state) == "12345\n6789... (+1 more)");
+
+        state += 1;
+        assert(to_string(state) == "12345\n6789... (+3 more)");
+        assert(state.omitted_bytes == 3);
+
+        builder{state}.begin_array().value(1).end_array();
+        assert(to_string(state) == "12345\n6789... (+9 more)");
+
+        deferred_output deferred{prefix_string{">"}};
+        deferred += 123456;
+        deferred += 789;
+        assert(to_string(deferred) == ">123456\n>7... (+2 more)");
+
+        global_settings() = original;
+    }
+
+    {
+        global_settings().max_output_bytes = 4;
+
+        output state;
+        state += "ab\xc3\xa5z";
+        assert(to_string(state) == "\"ab... (+4 more)"); // Doesn't split the UTF-8 sequence
+
+        global_settings() = original;
+    }
+}
+
+static std::string escaped_bytewise(const std::string& text)
+{
+    std::string escaped;
+    for (const char ch : text) {
+        switch (ch) {
+        case '"': escaped += "\\\""; break;
+        case '\\': escaped += "\\\\"; break;
+        case '\b': escaped += "\\b"; break;
+        case '\f': escaped += "\\f"; break;
+        case '\n': escaped += "\\n"; break;
+        case '\r': escaped += "\\r"; break;
+        case '\t': escaped += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(ch) < 0x20) {
+                char code[7];
+                std::snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned>(ch));
+                escaped += code;
+            } else {
+                escaped += ch;
+            }
+        }
+    }
+    return '"' + escaped + '"';
+}
+
+static void test_escaping()
+{
+    {
+        assert(to_string(value{"say \"hi\""}) == R"("say \"hi\"")");
+        assert(to_string(value{std::string{"C:\\temp"}}) == R"("C:\\temp")");
+        assert(to_string(value{"tab\tnewline\nreturn\r"}) == R"("tab\tnewline\nreturn\r")");
+        assert(to_string(value{"\x01\x1f\b\f"}) == R"("\u0001\u001f\b\f")");
+        assert(to_string(value{"caf\xc3\xa9 \x7f"}) == "\"caf\xc3\xa9 \x7f\"");
+        assert(to_string(property{"a \"name\"", 1}) == R"("a \"name\"": 1)");
+        assert(to_string(builder{}.key("k\\").value("v\n").release()) == R"("k\\": "v\n")");
+        assert(to_string(array({"\"", "\\"})) == R"([ "\"", "\\" ])");
+    }
+
+    {
+        // Special characters at every position relative to the 8 byte words that are scanned at a time
+        const char specials[] = { '"', '\\', '\n', '\x01', '\x1f', ' ', '\x7f', '\x80', '\xff', '!', '#', '[', '\\' };
+        for (std::size_t length = 0; length < 40; ++length) {
+            for (std::size_t position = 0; position < length; ++position) {
+                for (const char special : specials) {
+                    std::string text(length, 'x');
+                    text[position] = special;
+                    assert(to_string(value{text}) == escaped_bytewise(text));
+                }
+            }
+        }
+    }
+
+    {
+        const settings original = global_settings();
+        global_settings().escape_strings = false;
+        assert(to_string(value{"say \"hi\"\n"}) == "\"say \"hi\"\n\"");
+        global_settings() = original;
+    }
+
+    {
+        const settings original = global_settings();
+        global_settings().max_string_length = 3;
+        assert(to_string(value{"\"\"\"\""}) == "\"\\\"\\\"\\\"... (+1 more)\"");
+        global_settings() = original;
+    }
+}
+
+static void test_sink_output()
+{
+    {
+        std::ostringstream stream;
+        {
+            sink_output state{stream, prefix_string{"prefix: "}};
+            state += 1;
+            state += {"name", "foo"};
+            state.add(vector2d{1,2});
+            state.add("point", vector2d{3,4});
+            state += object({{"x", 1}});
+            assert(stream.str().empty());
+        }
+        assert(stream.str() == "prefix: 1\nprefix: \"name\": \"foo\"\nprefix: (1,2)\nprefix: \"point\": (3,4)\nprefix: { \"x\": 1 }\n");
+    }
+
+    {
+        std::vector<std::string> batches;
+        sink_output state{[&](const char* data, std::size_t size) { batches.emplace_back(data, size); }, {}, 8};
+        state += 1234;
+        assert(batches.empty());
+        state += 5678;
+        assert(batches.size() == 1 && batches[0] == "1234\n5678\n");
+        state += 9;
+        state.flush();
+        assert(batches.size() == 2 && batches[1] == "9\n");
+        state.flush();
+        assert(batches.size() == 2);
+        assert(state.pending.capacity() >= 8);
+    }
+
+    {
+        std::vector<std::string> batches;
+        sink_output state{[&](const char* data, std::size_t size) { batches.emplace_back(data, size); }, {}, 0};
+        state += 1;
+        state += 2;
+        assert(batches.size() == 2 && batches[1] == "2\n");
+    }
+
+    {
+        std::FILE* file = std::tmpfile();
+        assert(file);
+        {
+            sink_output state{file, google_test_prefix()};
+            state += 4711;
+        }
+        std::rewind(file);
+        char text[64] = {};
+        assert(std::fgets(text, sizeof(text), file));
+        assert(std::string{text} == "[    STATE ] 4711\n");
+
+#if !defined(_WIN32)
+        {
+            sink_output state{file_descriptor{fileno(file)}, {}, 0};
+            state += "fd";
+        }
+        std::rewind(file);
+        char all[64] = {};
+        const auto size = std::fread(all, 1, sizeof(all), file);
+        assert(std::string(all, size) == "[    STATE ] 4711\n\"fd\"\n");
+#endif
+        std::fclose(file);
+    }
+}
+
+static void test_concurrent_output()
+{
+    {
+        concurrent_output state{prefix_string{"prefix: "}};
+        state += 1;
+        state += {"two", 2};
+        state.add(vector2d{3,3});
+        state.add("four", 4);
+        assert(to_string(state) == "prefix: 1\nprefix: \"two\": 2\nprefix: (3,3)\nprefix: \"four\": 4");
+    }
+
+    {
+        concurrent_output state;
+        assert(to_string(state).empty());
+    }
+
+    {
+        const int thread_count = 8;
+        const int entry_count = 2000;
+
+        concurrent_output state;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_count; ++t)
+            threads.emplace_back([&state, t] {
+                for (int i = 0; i < entry_count; ++i)
+                    state += array({t, i});
+            });
+        for (auto& thread : threads)
+            thread.join();
+
+        assert(state.shards.size() == thread_count);
+
+        std::istringstream lines{to_string(state)};
+        std::vector<int> next(thread_count, 0);
+        std::string line;
+        int line_count = 0;
+        while (std::getline(lines, line)) {
+            int t = -1;
+            int i = -1;
+            assert(std::sscanf(line.c_str(), "[ %d, %d ]", &t, &i) == 2);
+            assert(next[static_cast<std::size_t>(t)] == i);
+            ++next[static_cast<std::size_t>(t)];
+            ++line_count;
+        }
+        assert(line_count == thread_count * entry_count);
+    }
+
+    {
+        // Entries added by different threads in a known order are merged in that order
+        concurrent_output state;
+        state += 1;
+        std::thread{[&state] { state += 2; }}.join();
+        state += 3;
+        std::thread{[&state] { state += 4; }}.join();
+        assert(to_string(state) == "1\n2\n3\n4");
+        assert(state.shards.size() >= 2); // A thread id can be reused once its thread has been joined
+    }
+
+    {
+        // The entries of all shards are limited to the output size, like those of an output
+        const auto original = global_settings();
+        global_settings().max_output_bytes = 10;
+
+        concurrent_output state;
+        state += 12345;
+        std::thread{[&state] { state += 67890; }}.join();
+        state += 1;
+        std::thread{[&state] { state += 23; }}.join();
+        assert(to_string(state) == "12345\n6789... (+6 more)");
+        assert(state.sequence == 2); // The last two entries were dropped when they were added
+
+        output expected;
+        expected += 12345;
+        expected += 67890;
+        expected += 1;
+        expected += 23;
+        assert(to_string(state) == to_string(expected));
+
+        global_settings() = original;
+    }
+}
+
+static void test_ring_output()
+{
+    {
+        ring_output state{1024, 3, prefix_string{"prefix: "}};
+        assert(to_string(state).empty());
+
+        state += 1;
+        state += {"two", 2};
+        assert(to_string(state) == "prefix: 1\nprefix: \"two\": 2");
+
+        state.add(3);
+        state.add("four", 4);
+        assert(to_string(state) == "prefix: \"two\": 2\nprefix: 3\nprefix: \"four\": 4");
+        assert(state.overwritten == 1);
+    }
+
+    {
+        // Byte capacity of 10, where entries wrap around the end of the byte ring
+        ring_output state{10, 100};
+        state += 1234;
+        state += 5678;
+        assert(to_string(state) == "1234\n5678");
+        state += 9012;
+        assert(to_string(state) == "5678\n9012");
+        state += 345678;
+        assert(to_string(state) == "9012\n345678");
+        state += 1;
+        state += 2;
+        state += 3;
+        state += 4;
+        assert(to_string(state) == "345678\n1\n2\n3\n4");
+        for (int i = 0; i < 1000; ++i)
+            state += i;
+        assert(to_string(state) == "997\n998\n999");
+        assert(state.overwritten == 1005);
+    }
+
+    {
+        ring_output state{4, 4};
+        state += "truncated";
+        assert(to_string(state) == "\"tru");
+    }
+
+    {
+        ring_output state{64, 8};
+        for (int i = 0; i < 100; ++i)
+            state += object({{"step", i}});
+        const auto capacity = state.scratch.capacity();
+        const auto bytes = state.bytes.data();
+        for (int i = 0; i < 100; ++i)
+            state.add("step", i);
+        assert(state.scratch.capacity() == capacity);
+        assert(state.bytes.data() == bytes);
+        assert(to_string(state) == "\"step\": 94\n\"step\": 95\n\"step\": 96\n\"step\": 97\n\"step\": 98\n\"step\": 99");
+    }
+}
+
+static void test_binary_capture()
+{
+    int target = 0;
+    const std::vector<int> ints { 1, -2, 3 };
+    const std::vector<double> doubles { 0.5, -1e300, 3.1415926 };
+    const std::vector<std::uint16_t> shorts { 1, 65535 };
+    const std::list<std::string> names { "a", "b\n" };
+
+    {
+        assert(to_string(binary::value{4711}) == to_string(value{4711}));
+        assert(to_string(binary::value{-4711471147114711ll}) == to_string(value{-4711471147114711ll}));
+        assert(to_string(binary::value{std::numeric_limits<std::uint64_t>::max()}) == to_string(value{std::numeric_limits<std::uint64_t>::max()}));
+        assert(to_string(binary::value{short{-3}}) == to_string(value{short{-3}}));
+        assert(to_string(binary::value{1.5f}) == to_string(value{1.5f}));
+        assert(to_string(binary::value{3.1415926}) == to_string(value{3.1415926}));
+        assert(to_string(binary::value{-1.25e-300l}) == to_string(value{-1.25e-300l}));
+        assert(to_string(binary::value{'x'}) == "x");
+        assert(to_string(binary::value{true}) == "true");
+        assert(to_string(binary::value{false}) == "false");
+        assert(to_string(binary::value{nullptr}) == "null");
+        assert(to_string(binary::value{&target}) == to_string(value{&target}));
+        assert(to_string(binary::value{"quoted \"text\""}) == "\"quoted \\\"text\\\"\"");
+        assert(to_string(binary::value{std::string{"text"}}) == "\"text\"");
+        assert(to_string(binary::value{vector2d{1, 2}}) == "(1,2)");
+        assert(to_string(binary::value{value{4711}}) == "4711");
+    }
+
+    {
+        const auto text = object({{"ints", array(ints)}, {"doubles", array(doubles)}, {"shorts", array(shorts)},
+                                  {"names", array(names)}, {"empty", array(std::vector<int>{})},
+                                  {"nested", object({{"point", vector2d{3, 4}}, {"flag", true}})},
+                                  {"values", array({1, "two", 3.0})}});
+        const auto encoded = binary::object({{"ints", binary::array(ints)}, {"doubles", binary::array(doubles)},
+                                             {"shorts", binary::array(shorts)}, {"names", binary::array(names)},
+                                             {"empty", binary::array(std::vector<int>{})},
+                                             {"nested", binary::object({{"point", vector2d{3, 4}}, {"flag", true}})},
+                                             {"values", binary::array({1, "two", 3.0})}});
+        assert(to_string(encoded) == to_string(text));
+        assert(to_string(binary::render(encoded)) == to_string(text));
+        assert(to_string(binary::object(binary::property{"a", 1})) == "{ \"a\": 1 }");
+        assert(to_string(binary::object(std::vector<binary::property>{})) == "{}");
+    }
+
+    {
+        output text{prefix_string{"prefix: "}};
+        text += 1;
+        text += {"two", 2};
+        text += array(ints);
+
+        binary::output encoded{prefix_string{"prefix: "}};
+        encoded += 1;
+        encoded += {"two", 2};
+        encoded += binary::array(ints);
+        assert(to_string(encoded) == to_string(text));
+
+        binary::output added{prefix_string{"prefix: "}};
+        added.add(1).add("two", 2).add(binary::array(ints));
+        assert(added.encoded.underlying == encoded.encoded.underlying);
+
+        // The numbers in an array are encoded as their bytes, after a few bytes of tags and count
+        assert(binary::array(ints).encoded.underlying.size() == 5 + ints.size() * sizeof(int));
+    }
+
+    {
+        const bool bools[] { true, false, true };
+        const std::array<bool, 2> bool_array {{ false, true }};
+        const std::vector<bool> bool_vector { true, true };
+        assert(to_string(binary::array(bools)) == "[ true, false, true ]");
+        assert(to_string(binary::array(bools)) == to_string(array(bools)));
+        assert(to_string(binary::array(bool_array)) == "[ false, true ]");
+        assert(to_string(binary::array(bool_vector)) == to_string(array(bool_vector)));
+    }
+
+    {
+        const settings original = global_settings();
+        global_settings().max_elements = 2;
+        const auto encoded = binary::array(ints);
+        const auto encoded_names = binary::array(names);
+        global_settings().max_elements = original.max_elements;
+
+        assert(to_string(encoded) == "[ 1, -2, ... (+1 more) ]");
+        assert(to_string(encoded_names) == "[ \"a\", \"b\\n\" ]");
+
+        binary::output state;
+        state += "abcdefgh";
+        state += 12345;
+        global_settings().max_string_length = 3;
+        global_settings().max_output_bytes = 22;
+        assert(to_string(state) == "\"abc... (+5 more)\"\n123... (+2 more)");
+        global_settings() = original;
+    }
+
+    {
+        // Strings are truncated when they're captured, and rendered with the marker they'd be formatted with
+        const settings original = global_settings();
+        global_settings().max_string_length = 4;
+        const std::string long_text(1000, 'x');
+        const binary::value encoded{long_text};
+        const binary::value encoded_utf8{"ab\xc3\xa5z"};
+        const auto text = to_string(value{long_text});
+        assert(encoded.encoded.underlying.size() < 16);
+        assert(to_string(encoded) == "\"xxxx... (+996 more)\"");
+        assert(to_string(encoded) == text);
+        assert(to_string(binary::value{"ab\"cdef"}) == "\"ab\\\"c... (+3 more)\"");
+        assert(to_string(encoded_utf8) == to_string(value{"ab\xc3\xa5z"}));
+
+        global_settings().max_string_length = 2;
+        assert(to_string(encoded) == "\"xx... (+998 more)\""); // A smaller budget when rendering still applies
+        global_settings() = original;
+        assert(to_string(encoded) == text);
+    }
+
+    {
+        binary::output state;
+        state += 1;
+        state.add("object", binary::object({{"a", 2}}));
+        const auto& encoded = state.encoded.underlying;
+
+        output rendered;
+        assert(binary::render(rendered, encoded.data(), encoded.size()));
+        assert(to_string(rendered) == "1\n\"object\": { \"a\": 2 }");
+
+        // Malformed or truncated encodings render the entries before the malformed one
+        const auto first_entry_size = 1 + sizeof(int);
+        for (std::size_t size = 1; size < encoded.size(); ++size) {
+            output truncated;
+            assert(binary::render(truncated, encoded.data(), size) == (size == first_entry_size));
+            assert(to_string(truncated) == (size < first_entry_size ? "" : "1"));
+        }
+        const char unbalanced[] = { static_cast<char>(binary::tag::begin_array), static_cast<char>(binary::tag::end_object) };
+        output malformed;
+        assert(!binary::render(malformed, unbalanced, sizeof(unbalanced)));
+        assert(to_string(malformed).empty());
+    }
+}
+
+#if !defined(_WIN32)
+static void test_mapped_output()
+{
+    const std::string path = "jg_test_state_test_mapped.log";
+    std::string entries;
+
+    {
+        mapped_output state{path, prefix_string{"> "}, 64};
+        assert(state.mapped());
+        state += 1;
+        state += {"two", 2};
+        state.add("long", std::string(100, 'x')); // Grows the file
+        assert(to_string(state) == "> 1\n> \"two\": 2\n> \"long\": \"" + std::string(100, 'x') + "\"");
+
+        assert(read_mapped_log(path, entries));
+        assert(entries == to_string(state));
+    }
+    assert(read_mapped_log(path, entries));
+    assert(entries == "> 1\n> \"two\": 2\n> \"long\": \"" + std::string(100, 'x') + "\"");
+
+    // The entries survive the writing process being killed
+    const pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        mapped_output state{path};
+        for (int i = 0; i < 1000; ++i)
+            state += i;
+        raise(SIGKILL);
+    }
+    int status = 0;
+    assert(waitpid(child, &status, 0) == child && WIFSIGNALED(status));
+    assert(read_mapped_log(path, entries));
+    assert(entries.substr(0, 6) == "0\n1\n2\n");
+    assert(entries.substr(entries.size() - 4) == "\n999");
+
+    {
+        // The entries are limited to the output size, like those of an output
+        const auto original = global_settings();
+        global_settings().max_output_bytes = 10;
+
+        mapped_output state{path};
+        state += 12345;
+        state += 67890;
+        assert(to_string(state) == "12345\n6789... (+1 more)");
+        state += 1;
+        assert(to_string(state) == "12345\n6789... (+3 more)");
+        assert(state.omitted_bytes == 3);
+        assert(read_mapped_log(path, entries));
+        assert(entries == to_string(state));
+
+        global_settings() = original;
+    }
+
+    const std::string not_a_log = "not a log at all";
+    assert(!read_mapped_log(not_a_log.data(), not_a_log.size(), entries));
+    assert(!mapped_output{"no/such/directory/file.log"}.mapped());
+    std::remove(path.c_str());
+}
+#endif
+
+static void test_moves()
+{
+    const std::string text(1000, 'x');
+
+    {
+        value large{text};
+        const auto data = large.formatted.underlying.data();
+        const auto allocations = allocation_count.load();
+        output state{std::move(large)};
+        assert(allocation_count == allocations);
+        assert(state.formatted.underlying.data() == data);
+
+        value next{text};
+        state += std::move(next);
+        assert(to_string(state) == "\"" + text + "\"\n\"" + text + "\"");
+    }
+
+    {
+        // The property has room for the brackets of the object
+        value large{text};
+        property named{"name", large};
+        const auto allocations = allocation_count.load();
+        output state{object(std::move(named))};
+        assert(allocation_count == allocations);
+        assert(to_string(state) == "{ \"name\": \"" + text + "\" }");
+
+        // The prefix doesn't fit in front of the value, so it's copied
+        output prefixed{prefix_string{"> "}, value{text}};
+        assert(to_string(prefixed) == "> \"" + text + "\"");
+    }
+
+    {
+        // A property name is inserted in front of a value that has room for it
+        value large{text};
+        large.formatted.underlying.reserve(2000);
+        const auto data = large.formatted.underlying.data();
+        const auto allocations = allocation_count.load();
+        output state;
+        state += property{"name", std::move(large)};
+        assert(allocation_count == allocations);
+        assert(state.formatted.underlying.data() == data);
+        assert(to_string(state) == "\"name\": \"" + text + "\"");
+
+        value escaped{1};
+        escaped.formatted.underlying.reserve(100);
+        assert(to_string(property{"\"", std::move(escaped)}) == "\"\\\"\": 1");
+    }
+
+    {
+        binary::value large{text};
+        const auto data = large.encoded.underlying.data();
+        binary::output state;
+        state += std::move(large);
+        assert(state.encoded.underlying.data() == data);
+    }
+}
+
+static void test_small_string()
+{
+    using detail::small_string;
+
+    {
+        // Typical leaf values and small objects don't allocate
+        const auto allocations = allocation_count.load();
+        const value number{4711};
+        const value pointer{&allocations};
+        const value text{"the quick brown fox"};
+        const value small = object({{"x", 1}, {"y", 2}, {"name", "first"}});
+        const output state{prefix_string{"[    STATE ] "}, property{"count", 17}};
+        assert(allocation_count == allocations);
+        assert(to_string(small) == "{ \"x\": 1, \"y\": 2, \"name\": \"first\" }");
+        assert(to_string(state) == "[    STATE ] \"count\": 17");
+    }
+
+    {
+        // Number arrays are formatted into a buffer of their upper bound, which is released if it's more
+        // than twice the text
+        const std::vector<int> ints(100, 7);
+        auto allocations = allocation_count.load();
+        const auto formatted = array(ints);
+        assert(allocation_count == allocations + 2);
+        assert(formatted.formatted.underlying.size() == 2 + 100 * 3);
+        assert(formatted.formatted.underlying.capacity() == formatted.formatted.underlying.size());
+
+        const std::vector<double> doubles(100, 0.12345678901234568);
+        allocations = allocation_count.load();
+        const auto kept = array(doubles);
+        assert(allocation_count == allocations + 1);
+        assert(kept.formatted.underlying.capacity() <= 2 * kept.formatted.underlying.size());
+    }
+
+    {
+        small_string text{"abc"};
+        text.insert(0, "01", 2);
+        text.insert(5, 2, '-');
+        assert(text == small_string{"01abc--"});
+
+        const std::string long_text(small_string::inline_capacity * 3, 'x');
+        text += long_text;
+        assert(text.size() == 7 + long_text.size());
+        assert(text.str() == "01abc--" + long_text);
+
+        small_string moved{std::move(text)};
+        assert(text.empty());
+        assert(moved.str() == "01abc--" + long_text);
+
+        moved.resize(3);
+        moved.shrink_to_fit();
+        assert(moved.capacity() == small_string::inline_capacity);
+        assert(moved == small_string{"01a"});
+
+        small_string copied;
+        copied = moved;
+        assert(copied == moved && copied.data() != moved.data());
+        copied = std::move(moved);
+        assert(copied == small_string{"01a"});
+    }
+
+    {
+        // Builders keep the state of the first 64 nesting levels inline
+        builder deep;
+        std::string expected;
+        for (int level = 0; level < 100; ++level) {
+            deep.begin_array().value(level);
+            expected += "[ " + std::to_string(level) + ", ";
+        }
+        expected.resize(expected.size() - 2);
+        for (int level = 0; level < 100; ++level) {
+            deep.end_array();
+            expected += " ]";
+        }
+        assert(to_string(deep.release()) == expected);
+    }
+}
+
+static void test_standard_types()
+{
+    const auto pair = std::make_pair(1, std::string{"one"});
+    const auto tuple = std::make_tuple(1, 2.5, "three", std::make_pair('c', true), vector2d{1, 2});
+
+    assert(to_string(value{pair}) == "[ 1, \"one\" ]");
+    assert(to_string(value{tuple}) == "[ 1, 2.5, \"three\", [ c, true ], (1,2) ]");
+    assert(to_string(value{std::tuple<>{}}) == "[]");
+    assert(to_string(value{std::make_tuple(std::make_tuple(1), std::tuple<>{})}) == "[ [ 1 ], [] ]");
+    assert(to_string(property{"pair", pair}) == "\"pair\": [ 1, \"one\" ]");
+
+    const std::vector<std::pair<int, int>> pairs { {1, 2}, {3, 4} };
+    assert(to_string(array(pairs)) == "[ [ 1, 2 ], [ 3, 4 ] ]");
+
+    deferred_output deferred;
+    deferred += pair;
+    assert(to_string(deferred) == "[ 1, \"one\" ]");
+
+    assert(to_string(binary::value{tuple}) == to_string(value{tuple}));
+    assert(to_string(binary::array(pairs)) == to_string(array(pairs)));
+
+#if defined(JG_TEST_STATE_OPTIONAL_VARIANT)
+    const std::optional<int> empty;
+    const std::optional<std::string> text{"text"};
+    const std::variant<int, std::string, std::monostate> number{4711};
+    const std::variant<int, std::string, std::monostate> name{std::string{"name"}};
+    const std::variant<int, std::string, std::monostate> nothing{std::monostate{}};
+
+    assert(to_string(value{empty}) == "null");
+    assert(to_string(value{text}) == "\"text\"");
+    assert(to_string(value{std::nullopt}) == "null");
+    assert(to_string(value{number}) == "4711");
+    assert(to_string(value{name}) == "\"name\"");
+    assert(to_string(value{nothing}) == "null");
+    assert(to_string(value{std::make_pair(empty, number)}) == "[ null, 4711 ]");
+    assert(to_string(binary::value{std::make_tuple(empty, text, name)}) == "[ null, \"text\", \"name\" ]");
+#endif
+}
+
+static void test_key_value_objects()
+{
+    const std::map<std::string, int> numbers { {"one", 1}, {"three", 3}, {"two", 2} };
+    assert(to_string(object(numbers)) == R"({ "one": 1, "three": 3, "two": 2 })");
+    assert(to_string(object(numbers)) == to_string(object({{"one", 1}, {"three", 3}, {"two", 2}})));
+    assert(to_string(object(std::map<std::string, int>{})) == "{}");
+    assert(to_string(object(std::unordered_map<std::string, std::string>{ {"key", "value"} })) == R"({ "key": "value" })");
+
+    const std::map<int, value> lists { {1, array({1})}, {2, array(std::vector<int>{})} };
+    assert(to_string(object(lists.begin(), lists.end())) == R"({ "1": [ 1 ], "2": [] })");
+    const std::map<char, bool> flags { {'a', true}, {'b', false} };
+    assert(to_string(object(flags)) == R"({ "a": true, "b": false })");
+
+    const std::vector<std::pair<const char*, double>> pairs { {"quote\"d", 0.5}, {"a", 1.5} };
+    assert(to_string(object(pairs)) == R"({ "quote\"d": 0.5, "a": 1.5 })");
+    assert(to_string(property{"nested", object(pairs)}) == R"("nested": { "quote\"d": 0.5, "a": 1.5 })");
+
+    const settings original = global_settings();
+    global_settings().max_elements = 2;
+    assert(to_string(object(numbers)) == R"({ "one": 1, "three": 3, ... (+1 more) })");
+    global_settings().max_elements = 0;
+    assert(to_string(object(numbers)) == "{ ... (+3 more) }");
+    global_settings() = original;
+
+    assert(to_string(binary::object(numbers)) == to_string(object(numbers)));
+    assert(to_string(binary::object(flags)) == to_string(object(flags)));
+    assert(to_string(binary::object(pairs)) == to_string(object(pairs)));
+}
+
+static void test_sampled_output()
+{
+    {
+        sampling policy;
+        policy.every_nth = 3;
+        sampled_output state{policy, prefix_string{"prefix: "}};
+        assert(to_string(state).empty());
+
+        int formats = 0;
+        for (int i = 0; i < 7; ++i)
+            state += counted_format{&formats};
+        assert(formats == 3);
+        assert(state.skipped == 4);
+        assert(to_string(state) == "prefix: counted\nprefix: counted\nprefix: counted\nprefix: ... (+4 skipped)");
+    }
+
+    {
+        sampling policy;
+        policy.max_per_window = 2;
+        policy.window = std::chrono::hours{1};
+        sampled_output state{policy};
+        for (int i = 0; i < 5; ++i)
+            state.add("step", i);
+        assert(to_string(state) == "\"step\": 0\n\"step\": 1\n... (+3 skipped)");
+
+        state.policy.window = std::chrono::steady_clock::duration::zero();
+        state += 5;
+        assert(state.skipped == 3);
+    }
+
+    {
+        int step = 0;
+        sampling policy;
+        policy.condition = [&step] { return step % 2 == 1; };
+        policy.every_nth = 2;
+        sampled_output state{policy};
+        for (step = 0; step < 8; ++step)
+            state += step;
+        assert(to_string(state) == "... (+8 skipped)"); // Odd steps are never the first of every 2nd entry
+
+        state.policy.every_nth = 1;
+        for (step = 0; step < 4; ++step)
+            state += property{"step", step};
+        assert(to_string(state) == "\"step\": 1\n\"step\": 3\n... (+10 skipped)");
+    }
+
+    {
+        sampled_output state{sampling{}};
+        state += 1;
+        state += {"two", 2};
+        assert(to_string(state) == "1\n\"two\": 2");
+        assert(state.skipped == 0);
+    }
+}
+
+struct spaced_point
+{
+    int x;
+    int y;
+};
+
+static std::ostream& operator<<(std::ostream& stream, const spaced_point& p)
+{
+    return stream << "P(" << p.x << ", " << p.y << ")";
+}
+
+struct bare_pair
+{
+    int first;
+    int second;
+};
+
+static std::ostream& operator<<(std::ostream& stream, const bare_pair& p)
+{
+    return stream << p.first << ", " << p.second;
+}
+
+static void test_delta_output()
+{
+    {
+        delta_output state{prefix_string{"prefix: "}};
+        assert(to_string(state).empty());
+
+        state += object({{"x", 1}, {"y", 2}, {"name", "a, \"b\" }"}});
+        state += object({{"x", 1}, {"y", 3}, {"name", "a, \"b\" }"}});
+        state += object({{"x", 1}, {"y", 3}, {"name", "a, \"b\" }"}});
+        state += object({{"name", "c"}, {"x", 1}, {"z", array({1, 2})}});
+        assert(to_string(state) ==
+               "prefix: { \"x\": 1, \"y\": 2, \"name\": \"a, \\\"b\\\" }\" }\n"
+               "prefix: { \"y\": 3 }\n"
+               "prefix: { \"name\": \"c\", \"z\": [ 1, 2 ], \"y\": (removed) }");
+        assert(state.snapshots == 4);
+        assert(state.unchanged == 1);
+    }
+
+    {
+        delta_output state;
+        state += object({{"nested", object({{"a", 1}, {"b", 2}})}, {"list", array({1, 2})}});
+        state += object({{"nested", object({{"a", 1}, {"b", 3}})}, {"list", array({1, 2})}});
+        state += object({});
+        state += object({});
+        state += object({{"a", 1}, {"a", 2}});
+        state += object({{"a", 1}, {"a", 3}});
+        assert(to_string(state) ==
+               "{ \"nested\": { \"a\": 1, \"b\": 2 }, \"list\": [ 1, 2 ] }\n"
+               "{ \"nested\": { \"a\": 1, \"b\": 3 } }\n"
+               "{ \"nested\": (removed), \"list\": (removed) }\n"
+               "{ \"a\": 1, \"a\": 2 }\n"
+               "{ \"a\": 3 }");
+        assert(state.unchanged == 1);
+    }
+
+    {
+        // Snapshots that aren't objects, or are truncated, are compared as a whole
+        delta_output state;
+        state += 1;
+        state += 1;
+        state += vector2d{1, 2};
+        state += object({{"a", 1}});
+
+        const settings original = global_settings();
+        global_settings().max_elements = 1;
+        state += object({{"a", 1}, {"b", 2}});
+        state += object({{"a", 1}, {"b", 2}});
+        global_settings() = original;
+
+        state += object({{"a", 1}});
+        state += object({{"a", 2}});
+        assert(to_string(state) ==
+               "1\n(1,2)\n{ \"a\": 1 }\n"
+               "{ \"a\": 1, ... (+1 more) }\n"
+               "{ \"a\": 1 }\n{ \"a\": 2 }");
+        assert(state.unchanged == 2);
+        assert(state.whole_snapshots == 5);
+    }
+
+    {
+        // User-defined text with ", " stays within its property
+        delta_output state;
+        for (int step = 0; step < 3; ++step)
+            state += object({{"position", spaced_point{1, 1}}, {"step", step / 2},
+                             {"pair", bare_pair{1, 2}}, {"list", array({spaced_point{2, 2}})}});
+        assert(to_string(state) ==
+               "{ \"position\": P(1, 1), \"step\": 0, \"pair\": 1, 2, \"list\": [ P(2, 2) ] }\n"
+               "{ \"step\": 1 }");
+        assert(state.unchanged == 1);
+        assert(state.whole_snapshots == 0);
+    }
+}
+
+static void test_interned_output()
+{
+    {
+        intern_table table;
+        interned_output state{table, prefix_string{"prefix: "}};
+        assert(to_string(state).empty());
+
+        for (int step = 0; step < 3; ++step) {
+            state.add("flag", true);
+            state.add("quote\"d", step);
+        }
+        state += nullptr;
+        state += {"name", 1};
+        assert(to_string(state) ==
+               "prefix: \"flag\": true\nprefix: \"quote\\\"d\": 0\n"
+               "prefix: \"flag\": true\nprefix: \"quote\\\"d\": 1\n"
+               "prefix: \"flag\": true\nprefix: \"quote\\\"d\": 2\n"
+               "prefix: null\nprefix: \"name\": 1");
+        assert(table.size() == 8); // 3 names, true, 0, 1, 2 and null
+        assert(state.entries.size() == 8);
+        assert(state.entries.back().name == table.intern_name("name"));
+
+        const std::string long_text(100, 'x');
+        state.add("long", long_text);
+        state.add("long", long_text);
+        assert(table.size() == 9);
+        assert(state.literals.count() == 1);
+        assert(to_string(state).substr(to_string(state).size() - 9) == "xxxxxxxx\"");
+
+        // Tables are shared by outputs
+        interned_output other{table};
+        other.add("flag", true);
+        other.add("other", 0);
+        assert(to_string(other) == "\"flag\": true\n\"other\": 0");
+        assert(table.size() == 10);
+    }
+
+    {
+        // Repeats don't allocate once the table and the output have grown
+        interned_output state;
+        state.entries.reserve(1000);
+        state.add("step", 4711);
+        const auto count = allocation_count.load();
+        for (int i = 0; i < 999; ++i)
+            state.add("step", 4711);
+        assert(allocation_count.load() == count);
+        assert(state.entries.size() == 1000);
+    }
+
+    {
+        // Many distinct texts grow the table
+        intern_table table;
+        interned_output state{table};
+        for (int i = 0; i < 1000; ++i)
+            state.add(std::to_string(i % 500), i);
+        assert(table.size() == 1500);
+        const auto text = to_string(state);
+        assert(text.substr(0, 20) == "\"0\": 0\n\"1\": 1\n\"2\": 2");
+        assert(text.substr(text.size() - 10) == "\"499\": 999");
+    }
+
+    {
+        // Outputs have tables of their own unless they're given one
+        interned_output state;
+        interned_output other;
+        state.add("own", 1);
+        assert(state.table != other.table);
+        assert(state.table->size() == 2);
+        assert(other.table->size() == 0);
+    }
+
+    {
+        // Full tables don't grow, and the output stores the texts that aren't in them
+        intern_table table{3};
+        interned_output state{table};
+        for (int i = 0; i < 4; ++i)
+            state.add("step", i);
+        state.add("other", 0);
+        state += {"last", 1};
+        assert(table.size() == 3);
+        assert(state.literals.count() == 4); // 2, 3, "other" and "last"
+        assert(to_string(state) ==
+               "\"step\": 0\n\"step\": 1\n\"step\": 2\n\"step\": 3\n\"other\": 0\n\"last\": 1");
+    }
+}
+
+struct throwing_format
+{
+    bool throws;
+};
+
+static std::ostream& operator<<(std::ostream& stream, const throwing_format& t)
+{
+    if (t.throws)
+        throw std::runtime_error{"throwing_format"};
+    return stream << "ok";
+}
+
+static void test_parallel_formatting()
+{
+    std::vector<vector2d> points;
+    std::vector<value> values;
+    std::vector<std::pair<std::string, moving_particle>> particles;
+    for (int i = 0; i < 1001; ++i) {
+        points.push_back({i, -i});
+        values.push_back(i % 3 ? value{i} : value{std::to_string(i)});
+        particles.emplace_back("p" + std::to_string(i), moving_particle{{i, i}, {1, -1}});
+    }
+    const std::list<vector2d> point_list(points.cbegin(), points.cend());
+
+    const auto serial_points = to_string(array(points));
+    const auto serial_values = to_string(array(values));
+    const auto serial_particles = to_string(object(particles));
+    const auto serial_list = to_string(array(point_list));
+
+    const settings original = global_settings();
+    global_settings().parallel_threshold = 2;
+
+    {
+        // The output is the same for any number of threads, also more threads than elements
+        for (const std::size_t threads : {0, 1, 2, 3, 7, 2000}) {
+            global_settings().parallel_threads = threads;
+            assert(to_string(array(points)) == serial_points);
+            assert(to_string(array(values)) == serial_values);
+            assert(to_string(object(particles)) == serial_particles);
+            assert(to_string(array(point_list)) == serial_list);
+            assert(to_string(array(points.data(), points.data() + 2)) == "[ (0,0), (1,-1) ]");
+            assert(to_string(array(points.data(), points.data() + 1)) == "[ (0,0) ]");
+            assert(to_string(array(points.data(), points.data())) == "[]");
+        }
+    }
+
+    {
+        // Truncation is the same too
+        global_settings().parallel_threads = 4;
+        global_settings().max_elements = 10;
+        const auto truncated = to_string(array(points));
+        assert(truncated.substr(truncated.size() - 33) == "(8,-8), (9,-9), ... (+991 more) ]");
+        const auto truncated_object = to_string(object(particles));
+        global_settings().parallel_threshold = std::numeric_limits<std::size_t>::max();
+        assert(to_string(array(points)) == truncated);
+        assert(to_string(object(particles)) == truncated_object);
+        global_settings().parallel_threshold = 2;
+        global_settings().max_elements = original.max_elements;
+    }
+
+    {
+        // Worker threads allocate from the memory resource of the calling thread
+        monotonic_resource arena{1024};
+        std::size_t size = 0;
+        {
+            scoped_resource scope{arena};
+            size = array(points).formatted.underlying.size();
+        }
+        assert(size == serial_points.size());
+        assert(arena.allocated() >= 2 * size);
+    }
+
+    {
+        // Exceptions from the stream output operators of the elements reach the caller
+        std::vector<throwing_format> formats(100, throwing_format{false});
+        formats[77].throws = true;
+        bool thrown = false;
+        try {
+            array(formats);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        formats[77].throws = false;
+        assert(to_string(array(formats)).substr(0, 12) == "[ ok, ok, ok");
+    }
+
+    global_settings() = original;
+}
+
+class counting_resource final : public memory_resource
+{
+public:
+    void* allocate(std::size_t size, std::size_t alignment) override
+    {
+        ++allocations;
+        bytes += size;
+        return new_delete_resource().allocate(size, alignment);
+    }
+
+    void deallocate(void* memory, std::size_t size, std::size_t alignment) noexcept override
+    {
+        ++deallocations;
+        bytes -= size;
+        new_delete_resource().deallocate(memory, size, alignment);
+    }
+
+    std::size_t allocations = 0;
+    std::size_t deallocations = 0;
+    std::size_t bytes = 0;
+};
+
+static void test_memory_resources()
+{
+    const std::string long_text(100, 'x');
+
+    {
+        // Text is deallocated to the resource it was allocated from, after the scope and after moves
+        counting_resource resource;
+        value moved{0};
+        {
+            scoped_resource scope{resource};
+            value text{long_text};
+            moved = std::move(text);
+            const value copy{moved};
+            assert(resource.allocations == 2);
+        }
+        assert(resource.deallocations == 1);
+        assert(&current_resource() == &new_delete_resource());
+
+        moved = value{1};
+        assert(resource.deallocations == 2);
+        assert(resource.bytes == 0);
+    }
+
+    {
+        // An arena on a stack buffer doesn't allocate from the global allocator
+        alignas(std::max_align_t) char buffer[8192];
+        counting_resource upstream;
+        monotonic_resource arena{buffer, sizeof(buffer), upstream};
+        const auto count = allocation_count.load();
+        {
+            scoped_resource scope{arena};
+            output state{prefix_string{"prefix: "}};
+            state += {"text", long_text};
+            state += object({{"text", long_text}, {"numbers", array({1, 2, 3})}});
+            assert(value{long_text}.formatted.underlying.size() == 102);
+            assert(state.formatted.underlying.size() > 250);
+        }
+        assert(allocation_count.load() == count);
+        assert(arena.allocated() > 300);
+        assert(upstream.allocations == 0);
+
+        // Blocks are allocated from upstream once the buffer runs out, and freed by `release()`
+        {
+            scoped_resource scope{arena};
+            for (int i = 0; i < 100; ++i)
+                value{long_text};
+        }
+        assert(upstream.allocations > 0);
+        arena.release();
+        assert(arena.allocated() == 0);
+        assert(upstream.bytes == 0);
+    }
+
+    {
+        // Scopes nest, and arenas can be shared by threads
+        monotonic_resource arena{64};
+        counting_resource resource;
+        scoped_resource outer{resource};
+        {
+            scoped_resource inner{arena};
+            std::vector<std::thread> threads;
+            for (int t = 0; t < 4; ++t)
+                threads.emplace_back([&arena, &long_text] {
+                    scoped_resource scope{arena};
+                    for (int i = 0; i < 100; ++i)
+                        value{long_text};
+                });
+            for (auto& thread : threads)
+                thread.join();
+            value{long_text};
+        }
+        assert(resource.allocations == 0);
+        assert(arena.allocated() >= 401 * 102);
+        value{long_text};
+        assert(resource.allocations == 1);
+    }
+
+    {
+        // Intern tables outlive arenas, so they don't allocate from them
+        intern_table table;
+        {
+            alignas(std::max_align_t) char buffer[4096];
+            {
+                monotonic_resource arena{buffer, sizeof(buffer)};
+                scoped_resource scope{arena};
+                interned_output state{table};
+                for (int i = 0; i < 20; ++i)
+                    state.add("arena name " + std::to_string(i), i);
+            }
+            std::memset(buffer, 'x', sizeof(buffer));
+        }
+        interned_output state{table};
+        for (int i = 0; i < 20; ++i)
+            state.add("arena name " + std::to_string(i), i);
+        state.add("after the arena", true);
+        assert(table.size() == 42);
+        const auto text = to_string(state);
+        assert(text.substr(0, 35) == "\"arena name 0\": 0\n\"arena name 1\": 1");
+        assert(text.substr(text.size() - 23) == "\"after the arena\": true");
+    }
+}
+
+#if defined(JG_TEST_STATE_STATS)
+static void test_statistics()
+{
+    const auto before = collect_statistics();
+
+    value{4711};
+    value{vector2d{1, 2}};
+    value{std::string(100, 'x')};
+    output state;
+    state += 1;
+    state += {"two", 2};
+    ring_output ring{1024, 4};
+    ring.add("three", 3);
+    std::ostringstream stream;
+    stream << state << ring;
+
+    std::thread{[] { value{vector2d{3, 4}}; }}.join(); // Counts of exited threads are kept
+
+    const auto after = collect_statistics();
+    assert(after.fast_values - before.fast_values == 5); // 4711, 100 x, 1, 2 and "three": 3
+    assert(after.stream_values - before.stream_values == 2);
+    assert(after.formatted_bytes - before.formatted_bytes == 4 + 5 + 102 + 1 + 1 + 10 + 5);
+    assert(after.allocations - before.allocations >= 1);
+    assert(after.appended_entries - before.appended_entries == 3);
+    assert(after.streamed_entries - before.streamed_entries == 3);
+    assert(after.formatting_nanoseconds > before.formatting_nanoseconds);
+
+    const auto text = to_string(object(after));
+    assert(text.substr(0, 17) == "{ \"fast_values\": ");
+    assert(text.find("\"formatting_nanoseconds\": ") != std::string::npos);
+    dump_statistics_at_exit(stdout);
+}
+#endif
+
+int main()
+{
+    test_value();
+    test_property();
+
+    test_user_defined_type();
+    test_user_defined_output();
+
+    test_object();
+    test_array();
+    test_prefix();
+
+    test_ctors_simple_value();
+    test_static_ctors_simple_value();
+    test_ctors_complex_value();
+    test_ctors_simple_property();
+    test_ctors_complex_property();
+
+    test_builder();
+    test_scalar_formatting();
+    test_floating_point();
+    test_deferred_output();
+    test_stream_reuse();
+    test_number_array();
+    test_input_iterators();
+    test_budgets();
+    test_escaping();
+    test_sink_output();
+    test_concurrent_output();
+    test_ring_output();
+    test_binary_capture();
+    test_moves();
+    test_small_string();
+    test_standard_types();
+    test_key_value_objects();
+    test_sampled_output();
+    test_delta_output();
+    test_interned_output();
+    test_memory_resources();
+    test_parallel_formatting();
+#if defined(JG_TEST_STATE_STATS)
+    test_statistics();
+#endif
+#if !defined(_WIN32)
+    test_mapped_output();
+#endif
 }
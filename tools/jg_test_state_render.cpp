@@ -0,0 +1,64 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <jg_test_state.h>
+
+using namespace jg::test_state;
+
+// Renders a file of binary encoded entries, like the bytes of `binary::output::encoded`, or the entries of a
+// file written by `mapped_output`, to text.
+static bool render_file(std::istream& file, const char* name, const prefix_string& prefix)
+{
+    const std::string encoded{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+#if !defined(_WIN32)
+    std::string entries;
+    if (read_mapped_log(encoded.data(), encoded.size(), entries)) {
+        if (!entries.empty())
+            std::cout << entries << '\n';
+        return true;
+    }
+#endif
+
+    output rendered{prefix};
+    const bool valid = binary::render(rendered, encoded.data(), encoded.size());
+    if (!rendered.formatted.underlying.empty())
+        std::cout << rendered << '\n';
+    if (!valid)
+        std::fprintf(stderr, "jg_test_state_render: %s: malformed or truncated encoding\n", name);
+    return valid;
+}
+
+// Usage: jg_test_state_render [--prefix text] [file ...]
+// The prefix is only used for binary encoded entries, since the entries of mapped logs are already prefixed.
+// Renders standard input if no files are given.
+int main(int argc, char* argv[])
+{
+    prefix_string prefix;
+    std::vector<const char*> files;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--prefix") == 0 && i + 1 < argc)
+            prefix = prefix_string{argv[++i]};
+        else
+            files.push_back(argv[i]);
+    }
+
+    if (files.empty())
+        return render_file(std::cin, "<stdin>", prefix) ? 0 : 1;
+
+    int result = 0;
+    for (const auto name : files) {
+        std::ifstream file{name, std::ios::binary};
+        if (!file) {
+            std::fprintf(stderr, "jg_test_state_render: %s: cannot open\n", name);
+            result = 1;
+        } else if (!render_file(file, name, prefix)) {
+            result = 1;
+        }
+    }
+    return result;
+}